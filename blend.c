@@ -0,0 +1,183 @@
+#include <math.h>
+#include "blend.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* fill_span() and palette_span() build this many pixels at a time on the */
+/* stack and blend them with blend_span(). */
+#define SPAN_CHUNK 64
+
+static int clamp_alpha(int alpha) {
+  return alpha < 0 ? 0 : alpha > 256 ? 256 : alpha;
+}
+
+/* With alpha in 0..256, src*alpha + dst*(256 - alpha) is at most 255*256, */
+/* so the vector code works in unsigned 16-bit lanes. */
+void blend_span(pixel* dst, const pixel* src, int alpha, int n) {
+  byte* d = (byte*) dst;
+  const byte* s = (const byte*) src;
+  int i = 0, bytes = n*3;
+
+  alpha = clamp_alpha(alpha);
+#if defined(__SSE2__)
+  __m128i a = _mm_set1_epi16(alpha), ia = _mm_set1_epi16(256 - alpha);
+  __m128i zero = _mm_setzero_si128(), sv, dv, lo, hi;
+  for (; i + 16 <= bytes; i += 16) {
+    sv = _mm_loadu_si128((const __m128i*) (s + i));
+    dv = _mm_loadu_si128((const __m128i*) (d + i));
+    lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(sv, zero), a),
+                       _mm_mullo_epi16(_mm_unpacklo_epi8(dv, zero), ia));
+    hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(sv, zero), a),
+                       _mm_mullo_epi16(_mm_unpackhi_epi8(dv, zero), ia));
+    _mm_storeu_si128((__m128i*) (d + i),
+                     _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                      _mm_srli_epi16(hi, 8)));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint8x16_t sv, dv;
+  uint16x8_t lo, hi;
+  for (; i + 16 <= bytes; i += 16) {
+    sv = vld1q_u8(s + i);
+    dv = vld1q_u8(d + i);
+    lo = vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_low_u8(sv)), alpha),
+                     vmovl_u8(vget_low_u8(dv)), 256 - alpha);
+    hi = vmlaq_n_u16(vmulq_n_u16(vmovl_u8(vget_high_u8(sv)), alpha),
+                     vmovl_u8(vget_high_u8(dv)), 256 - alpha);
+    vst1q_u8(d + i, vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+  }
+#endif
+  for (; i < bytes; i++) {
+    d[i] = (s[i]*alpha + d[i]*(256 - alpha)) >> 8;
+  }
+}
+
+void add_span(pixel* dst, const pixel* src, int alpha, int n) {
+  byte* d = (byte*) dst;
+  const byte* s = (const byte*) src;
+  int i = 0, bytes = n*3, v;
+
+  alpha = clamp_alpha(alpha);
+#if defined(__SSE2__)
+  __m128i a = _mm_set1_epi16(alpha), zero = _mm_setzero_si128(), sv, lo, hi;
+  for (; i + 16 <= bytes; i += 16) {
+    sv = _mm_loadu_si128((const __m128i*) (s + i));
+    lo = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(sv, zero), a), 8);
+    hi = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(sv, zero), a), 8);
+    _mm_storeu_si128((__m128i*) (d + i), _mm_adds_epu8(
+        _mm_loadu_si128((const __m128i*) (d + i)), _mm_packus_epi16(lo, hi)));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  uint8x16_t sv;
+  uint8x8_t lo, hi;
+  for (; i + 16 <= bytes; i += 16) {
+    sv = vld1q_u8(s + i);
+    lo = vshrn_n_u16(vmulq_n_u16(vmovl_u8(vget_low_u8(sv)), alpha), 8);
+    hi = vshrn_n_u16(vmulq_n_u16(vmovl_u8(vget_high_u8(sv)), alpha), 8);
+    vst1q_u8(d + i, vqaddq_u8(vld1q_u8(d + i), vcombine_u8(lo, hi)));
+  }
+#endif
+  for (; i < bytes; i++) {
+    v = d[i] + ((s[i]*alpha) >> 8);
+    d[i] = v > 255 ? 255 : v;
+  }
+}
+
+void fill_span(pixel* dst, pixel colour, int alpha, int n) {
+  pixel run[SPAN_CHUNK];
+  int i;
+
+  for (i = 0; i < SPAN_CHUNK && i < n; i++) {
+    run[i] = colour;
+  }
+  for (; n > 0; n -= SPAN_CHUNK, dst += SPAN_CHUNK) {
+    blend_span(dst, run, alpha, n < SPAN_CHUNK ? n : SPAN_CHUNK);
+  }
+}
+
+void palette_span(pixel* dst, const byte* palette, int size, const double* f,
+                  int alpha, int n) {
+  pixel run[SPAN_CHUNK];
+  const byte* c;
+  int i, count;
+
+  for (; n > 0; n -= count, dst += count, f += count) {
+    count = n < SPAN_CHUNK ? n : SPAN_CHUNK;
+    for (i = 0; i < count; i++) {
+      c = palette_colour(palette, size, f[i]);
+      run[i].r = c[0];
+      run[i].g = c[1];
+      run[i].b = c[2];
+    }
+    blend_span(dst, run, alpha, count);
+  }
+}
+
+static int floor_sqrt(int x) {
+  int s = sqrt(x);
+  while (s*s > x) {
+    s--;
+  }
+  while ((s + 1)*(s + 1) <= x) {
+    s++;
+  }
+  return s;
+}
+
+/* Adds the colour to columns from..to of one row, wrapping every 'columns'. */
+static void add_columns(pixel* row, int columns, int col_limit, int from,
+                        int to, pixel colour) {
+  int c, n, v;
+  pixel* p;
+
+  from = from < 0 ? 0 : from;
+  to = to >= col_limit ? col_limit - 1 : to;
+  for (; from <= to; from += n) {
+    c = from % columns;
+    n = columns - c < to - from + 1 ? columns - c : to - from + 1;
+    for (p = row + c; p < row + c + n; p++) {
+      v = p->r + colour.r;
+      p->r = v > 255 ? 255 : v;
+      v = p->g + colour.g;
+      p->g = v > 255 ? 255 : v;
+      v = p->b + colour.b;
+      p->b = v > 255 ? 255 : v;
+    }
+  }
+}
+
+void add_ring(pixel* grid, int rows, int columns, int col_limit, int row,
+              int col, int min_sq, int max_sq, pixel colour) {
+  int r, first, last, dr_sq, inner, outer;
+
+  if (max_sq < 0) {
+    return;
+  }
+  outer = floor_sqrt(max_sq);
+  first = row - outer < 0 ? 0 : row - outer;
+  last = row + outer >= rows ? rows - 1 : row + outer;
+  for (r = first; r <= last; r++) {
+    dr_sq = (r - row)*(r - row);
+    if (dr_sq > max_sq) {
+      continue;
+    }
+    /* Column offsets from inner to outer are in the ring on this row. */
+    outer = floor_sqrt(max_sq - dr_sq);
+    inner = min_sq - dr_sq <= 0 ? 0 : floor_sqrt(min_sq - dr_sq - 1) + 1;
+    if (inner > outer) {
+      continue;
+    }
+    if (inner == 0) {
+      add_columns(grid + r*columns, columns, col_limit, col - outer,
+                  col + outer, colour);
+    } else {
+      add_columns(grid + r*columns, columns, col_limit, col - outer,
+                  col - inner, colour);
+      add_columns(grid + r*columns, columns, col_limit, col + inner,
+                  col + outer, colour);
+    }
+  }
+}
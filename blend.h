@@ -0,0 +1,86 @@
+// Painting colours over pixels, one at a time or in spans.  Nothing here
+// keeps any state, so patterns can paint from worker threads.
+#ifndef BLEND_H
+#define BLEND_H
+
+#include <math.h>
+
+#ifndef TYPEDEF_BYTE
+#define TYPEDEF_BYTE
+typedef unsigned char byte;
+#endif
+
+#ifndef TYPEDEF_PIXEL
+#define TYPEDEF_PIXEL
+typedef struct { byte r, g, b; } pixel;
+#endif
+
+// Single pixels ===========================================================
+
+// Paints a colour over a pixel with an alpha from 0 (none) to 256 (all).
+// The colour and alpha may be out of range; the result is clamped.
+static inline void blend_rgb(pixel* p, long red, long green, long blue,
+                             long alpha) {
+  long v = (red*alpha + p->r*(256 - alpha)) >> 8;
+  p->r = v < 0 ? 0 : v > 255 ? 255 : v;
+  v = (green*alpha + p->g*(256 - alpha)) >> 8;
+  p->g = v < 0 ? 0 : v > 255 ? 255 : v;
+  v = (blue*alpha + p->b*(256 - alpha)) >> 8;
+  p->b = v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Adds alpha/256 of a colour to a pixel, clamped.
+static inline void add_rgb(pixel* p, long red, long green, long blue,
+                           long alpha) {
+  long v = ((red*alpha) >> 8) + p->r;
+  p->r = v < 0 ? 0 : v > 255 ? 255 : v;
+  v = ((green*alpha) >> 8) + p->g;
+  p->g = v < 0 ? 0 : v > 255 ? 255 : v;
+  v = ((blue*alpha) >> 8) + p->b;
+  p->b = v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+// Returns the colour at position f in a palette of 'size' RGB triples;
+// only the fractional part of f matters.
+static inline const byte* palette_colour(const byte* palette, int size,
+                                         double f) {
+  return palette + ((int) ((f - floor(f))*size))*3;
+}
+
+// Paints the colour at position f in a palette over a pixel.
+static inline void blend_palette(pixel* p, const byte* palette, int size,
+                                 double f, long alpha) {
+  const byte* c = palette_colour(palette, size, f);
+  blend_rgb(p, c[0], c[1], c[2], alpha);
+}
+
+// Spans ===================================================================
+// These work on n consecutive pixels with one alpha, which is clamped to
+// 0..256, so no pixel needs clamping.  They use SSE2 or NEON if the build
+// has them.
+
+// dst = (src*alpha + dst*(256 - alpha))/256
+void blend_span(pixel* dst, const pixel* src, int alpha, int n);
+
+// dst = min(255, dst + src*alpha/256)
+void add_span(pixel* dst, const pixel* src, int alpha, int n);
+
+// Paints one colour over every pixel.
+void fill_span(pixel* dst, pixel colour, int alpha, int n);
+
+// Paints the palette colour at position f[i] over dst[i].
+void palette_span(pixel* dst, const byte* palette, int size, const double* f,
+                  int alpha, int n);
+
+// Shapes ==================================================================
+
+// Adds a colour, saturating, to every pixel of a grid ('columns' pixels per
+// row) whose squared distance from (row, col) is from min_sq to max_sq.
+// Only rows 0..rows - 1 and columns 0..col_limit - 1 are drawn; columns
+// wrap around the grid, so with col_limit > columns a ring can reach round
+// the cylinder more than once and add to some pixels more than once.  Only
+// the spans inside the ring are visited.
+void add_ring(pixel* grid, int rows, int columns, int col_limit, int row,
+              int col, int min_sq, int max_sq, pixel colour);
+
+#endif  // BLEND_H
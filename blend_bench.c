@@ -0,0 +1,117 @@
+// Checks the blend.h span functions against painting the same pixels one
+// at a time, then measures how many pixels per second each one paints.
+//
+//   gcc -std=c99 -O3 blend_bench.c blend.c -lm -o bin/blend_bench
+//   bin/blend_bench 20000
+//
+// Exits with status 1 if a span function paints any pixel differently.
+
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "serpent.h"
+#include "blend.h"
+#include "spectrum.pal"
+
+static pixel dst[NUM_PIXELS], src[NUM_PIXELS], expected[NUM_PIXELS];
+static pixel start[NUM_PIXELS];
+static double f[NUM_PIXELS];
+static pixel colour = {200, 100, 50};
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+// Ops are numbered in pairs: a loop over the per-pixel function, then the
+// span function that replaces it.
+#define NUM_OPS 8
+
+// Paints dst the way the spans do, using the per-pixel functions.
+void paint_one_at_a_time(int op, int alpha) {
+  int i;
+
+  for (i = 0; i < NUM_PIXELS; i++) {
+    switch (op) {
+      case 0:
+        blend_rgb(&dst[i], src[i].r, src[i].g, src[i].b, alpha);
+        break;
+      case 2:
+        add_rgb(&dst[i], src[i].r, src[i].g, src[i].b, alpha);
+        break;
+      case 4:
+        blend_rgb(&dst[i], colour.r, colour.g, colour.b, alpha);
+        break;
+      default:
+        blend_palette(&dst[i], SPECTRUM_PALETTE, SPECTRUM_PALETTE_SIZE, f[i],
+                      alpha);
+    }
+  }
+}
+
+void paint(int op, int alpha) {
+  switch (op) {
+    case 1:
+      blend_span(dst, src, alpha, NUM_PIXELS);
+      break;
+    case 3:
+      add_span(dst, src, alpha, NUM_PIXELS);
+      break;
+    case 5:
+      fill_span(dst, colour, alpha, NUM_PIXELS);
+      break;
+    case 7:
+      palette_span(dst, SPECTRUM_PALETTE, SPECTRUM_PALETTE_SIZE, f, alpha,
+                   NUM_PIXELS);
+      break;
+    default:
+      paint_one_at_a_time(op, alpha);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  char* names[NUM_OPS] = {"blend_rgb", "blend_span", "add_rgb", "add_span",
+                          "blend_rgb (fill)", "fill_span", "blend_palette",
+                          "palette_span"};
+  int frames = argc > 1 ? atoi(argv[1]) : 10000;
+  int i, k, alpha, failed = 0;
+  double begin, elapsed;
+
+  for (i = 0; i < NUM_PIXELS; i++) {
+    start[i].r = random();
+    start[i].g = random();
+    start[i].b = random();
+    src[i].r = random();
+    src[i].g = random();
+    src[i].b = random();
+    f[i] = (random() % 100000)*0.0001 - 5;
+  }
+
+  for (k = 1; k < NUM_OPS; k += 2) {
+    for (alpha = -10; alpha <= 266; alpha++) {
+      memcpy(dst, start, sizeof(dst));
+      paint_one_at_a_time(k - 1, clamp(alpha, 0, 256));
+      memcpy(expected, dst, sizeof(dst));
+      memcpy(dst, start, sizeof(dst));
+      paint(k, alpha);
+      if (memcmp(dst, expected, sizeof(dst))) {
+        fprintf(stderr, "%s differs at alpha %d\n", names[k], alpha);
+        failed = 1;
+      }
+    }
+  }
+  for (k = 0; k < NUM_OPS; k++) {
+    memcpy(dst, start, sizeof(dst));
+    begin = get_time();
+    for (i = 0; i < frames; i++) {
+      paint(k, 100 + (i & 127));
+    }
+    elapsed = get_time() - begin;
+    printf("%-18s %8.2f us/frame  %8.1f Mpixels/s\n", names[k],
+           elapsed*1e6/frames, NUM_PIXELS*(double) frames/elapsed/1e6);
+  }
+  return failed;
+}
@@ -0,0 +1,168 @@
+#include "colour.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* The hue circle is split into sextants of 42.5 hue steps; (hue*2)/85 is */
+/* the sextant, with 6 the same as 0.  In each sextant, each channel is */
+/* either the value, the minimum (value less chroma), or the minimum plus */
+/* a part of the chroma that rises or falls across the sextant. */
+#define PICK_MIN 0
+#define PICK_MID 1
+#define PICK_VAL 2
+
+static const byte picks[7][3] = {
+  {PICK_VAL, PICK_MID, PICK_MIN},
+  {PICK_MID, PICK_VAL, PICK_MIN},
+  {PICK_MIN, PICK_VAL, PICK_MID},
+  {PICK_MIN, PICK_MID, PICK_VAL},
+  {PICK_MID, PICK_MIN, PICK_VAL},
+  {PICK_VAL, PICK_MIN, PICK_MID},
+  {PICK_VAL, PICK_MID, PICK_MIN}
+};
+
+void hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix) {
+  byte chr = (val*sat + 255)>>8;
+  byte min = val - chr;
+  byte phase = hue % 85;
+  byte levels[3];
+  const byte* pick = picks[(hue*2)/85];
+
+  phase = (phase >= 43) ? 85 - phase : phase;
+  levels[PICK_MIN] = min;
+  levels[PICK_MID] = ((unsigned int) chr * phase*6 + 127) / 255 + min;
+  levels[PICK_VAL] = val;
+  pix->r = levels[pick[0]];
+  pix->g = levels[pick[1]];
+  pix->b = levels[pick[2]];
+}
+
+/* The vector versions work on eight colours at a time in 16-bit lanes. */
+/* No product reaches 2^16: val*sat + 255 is at most 65280 and */
+/* chr*phase*6 + 127 at most 64387.  They divide by multiplying: */
+/* (hue*2)/85 is (hue*2*772) >> 16 for any byte hue, and n/255 is */
+/* (n*0x8081) >> 23 for any 16-bit n. */
+#if defined(__SSE2__)
+
+/* Picks val, mid or min in each lane. */
+static __m128i pick_sse2(__m128i use_val, __m128i use_mid, __m128i val,
+                         __m128i mid, __m128i min) {
+  return _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(use_val, val), _mm_and_si128(use_mid, mid)),
+      _mm_andnot_si128(_mm_or_si128(use_val, use_mid), min));
+}
+
+void hsv_to_rgb_span(const byte* hue, const byte* sat, const byte* val,
+                     pixel* out, int n) {
+  __m128i zero = _mm_setzero_si128(), h, s, v, chr, min, k, phase, far, mid;
+  __m128i e[6], r, g, b;
+  byte rgb[3][16];
+  int i = 0, j;
+
+  for (; i + 8 <= n; i += 8) {
+    h = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (hue + i)), zero);
+    s = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (sat + i)), zero);
+    v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*) (val + i)), zero);
+    chr = _mm_srli_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(v, s), _mm_set1_epi16(255)), 8);
+    min = _mm_sub_epi16(v, chr);
+    k = _mm_mulhi_epu16(_mm_add_epi16(h, h), _mm_set1_epi16(772));
+    phase = _mm_sub_epi16(
+        h, _mm_mullo_epi16(_mm_srli_epi16(k, 1), _mm_set1_epi16(85)));
+    far = _mm_cmpgt_epi16(phase, _mm_set1_epi16(42));
+    phase = _mm_or_si128(
+        _mm_and_si128(far, _mm_sub_epi16(_mm_set1_epi16(85), phase)),
+        _mm_andnot_si128(far, phase));
+    mid = _mm_mullo_epi16(chr, _mm_mullo_epi16(phase, _mm_set1_epi16(6)));
+    mid = _mm_srli_epi16(_mm_mulhi_epu16(
+        _mm_add_epi16(mid, _mm_set1_epi16(127)),
+        _mm_set1_epi16((short) 0x8081)), 7);
+    mid = _mm_add_epi16(mid, min);
+    for (j = 0; j < 6; j++) {
+      e[j] = _mm_cmpeq_epi16(k, _mm_set1_epi16(j));
+    }
+    e[0] = _mm_or_si128(e[0], _mm_cmpeq_epi16(k, _mm_set1_epi16(6)));
+    r = pick_sse2(_mm_or_si128(e[0], e[5]), _mm_or_si128(e[1], e[4]),
+                  v, mid, min);
+    g = pick_sse2(_mm_or_si128(e[1], e[2]), _mm_or_si128(e[0], e[3]),
+                  v, mid, min);
+    b = pick_sse2(_mm_or_si128(e[3], e[4]), _mm_or_si128(e[2], e[5]),
+                  v, mid, min);
+    _mm_storeu_si128((__m128i*) rgb[0], _mm_packus_epi16(r, zero));
+    _mm_storeu_si128((__m128i*) rgb[1], _mm_packus_epi16(g, zero));
+    _mm_storeu_si128((__m128i*) rgb[2], _mm_packus_epi16(b, zero));
+    for (j = 0; j < 8; j++) {
+      out[i + j].r = rgb[0][j];
+      out[i + j].g = rgb[1][j];
+      out[i + j].b = rgb[2][j];
+    }
+  }
+  for (; i < n; i++) {
+    hsv_to_rgb(hue[i], sat[i], val[i], &out[i]);
+  }
+}
+
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+
+/* Returns (x*m) >> 16 in each lane. */
+static uint16x8_t mulhi_neon(uint16x8_t x, uint16_t m) {
+  uint16x4_t mv = vdup_n_u16(m);
+  return vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(x), mv), 16),
+                      vshrn_n_u32(vmull_u16(vget_high_u16(x), mv), 16));
+}
+
+static uint8x8_t pick_neon(uint16x8_t use_val, uint16x8_t use_mid,
+                           uint16x8_t val, uint16x8_t mid, uint16x8_t min) {
+  return vmovn_u16(vbslq_u16(use_val, val, vbslq_u16(use_mid, mid, min)));
+}
+
+void hsv_to_rgb_span(const byte* hue, const byte* sat, const byte* val,
+                     pixel* out, int n) {
+  uint16x8_t h, s, v, chr, min, k, phase, mid, e[6];
+  uint8x8x3_t rgb;
+  int i = 0, j;
+
+  for (; i + 8 <= n; i += 8) {
+    h = vmovl_u8(vld1_u8(hue + i));
+    s = vmovl_u8(vld1_u8(sat + i));
+    v = vmovl_u8(vld1_u8(val + i));
+    chr = vshrq_n_u16(vmlaq_u16(vdupq_n_u16(255), v, s), 8);
+    min = vsubq_u16(v, chr);
+    k = mulhi_neon(vaddq_u16(h, h), 772);
+    phase = vsubq_u16(h, vmulq_n_u16(vshrq_n_u16(k, 1), 85));
+    phase = vbslq_u16(vcgtq_u16(phase, vdupq_n_u16(42)),
+                      vsubq_u16(vdupq_n_u16(85), phase), phase);
+    mid = vaddq_u16(vmulq_u16(chr, vmulq_n_u16(phase, 6)), vdupq_n_u16(127));
+    mid = vaddq_u16(vshrq_n_u16(mulhi_neon(mid, 0x8081), 7), min);
+    for (j = 0; j < 6; j++) {
+      e[j] = vceqq_u16(k, vdupq_n_u16(j));
+    }
+    e[0] = vorrq_u16(e[0], vceqq_u16(k, vdupq_n_u16(6)));
+    rgb.val[0] = pick_neon(vorrq_u16(e[0], e[5]), vorrq_u16(e[1], e[4]),
+                           v, mid, min);
+    rgb.val[1] = pick_neon(vorrq_u16(e[1], e[2]), vorrq_u16(e[0], e[3]),
+                           v, mid, min);
+    rgb.val[2] = pick_neon(vorrq_u16(e[3], e[4]), vorrq_u16(e[2], e[5]),
+                           v, mid, min);
+    vst3_u8((byte*) (out + i), rgb);
+  }
+  for (; i < n; i++) {
+    hsv_to_rgb(hue[i], sat[i], val[i], &out[i]);
+  }
+}
+
+#else
+
+void hsv_to_rgb_span(const byte* hue, const byte* sat, const byte* val,
+                     pixel* out, int n) {
+  int i;
+
+  for (i = 0; i < n; i++) {
+    hsv_to_rgb(hue[i], sat[i], val[i], &out[i]);
+  }
+}
+
+#endif
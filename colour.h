@@ -0,0 +1,25 @@
+// Converting colours from hue, saturation and value to RGB, one at a time
+// or in spans.  Nothing here keeps any state, so patterns can convert
+// colours from worker threads.
+#ifndef COLOUR_H
+#define COLOUR_H
+
+#ifndef TYPEDEF_BYTE
+#define TYPEDEF_BYTE
+typedef unsigned char byte;
+#endif
+
+#ifndef TYPEDEF_PIXEL
+#define TYPEDEF_PIXEL
+typedef struct { byte r, g, b; } pixel;
+#endif
+
+// hue = 0..254 (255 is the same as 0), sat = 0..255, val = 0..255
+void hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix);
+
+// Converts n colours, giving exactly what hsv_to_rgb() gives for each.
+// Uses SSE2 or NEON if the build has them.
+void hsv_to_rgb_span(const byte* hue, const byte* sat, const byte* val,
+                     pixel* out, int n);
+
+#endif  // COLOUR_H
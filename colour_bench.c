@@ -0,0 +1,130 @@
+// Checks hsv_to_rgb() and hsv_to_rgb_span() against the switch-based
+// conversion that master.c and the foundation patterns each had a copy of,
+// for every hue, saturation and value, then times them per frame.
+//
+//   gcc -std=c99 -O3 colour_bench.c colour.c -o bin/colour_bench
+//   bin/colour_bench 20000
+//
+// Exits with status 1 if any colour comes out differently.
+
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "serpent.h"
+#include "colour.h"
+
+static byte hue[NUM_PIXELS], sat[NUM_PIXELS], val[NUM_PIXELS];
+static pixel expected[NUM_PIXELS], out[NUM_PIXELS];
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+// hsv_to_rgb() from master.c, before colour.c.
+void switch_hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix) {
+  byte chr = (val*sat + 255)>>8;
+  byte min = val - chr;
+  byte phase = hue % 85;
+  byte x;
+
+  phase = (phase >= 43) ? 85 - phase : phase;
+  x = ((unsigned int) chr * phase*6 + 127) / 255;
+  switch ((hue*2)/85) {
+    case 0:
+    case 6:
+      pix->r = val;
+      pix->g = x + min;
+      pix->b = min;
+      break;
+    case 1:
+      pix->r = x + min;
+      pix->g = val;
+      pix->b = min;
+      break;
+    case 2:
+      pix->r = min;
+      pix->g = val;
+      pix->b = x + min;
+      break;
+    case 3:
+      pix->r = min;
+      pix->g = x + min;
+      pix->b = val;
+      break;
+    case 4:
+      pix->r = x + min;
+      pix->g = min;
+      pix->b = val;
+      break;
+    case 5:
+      pix->r = val;
+      pix->g = min;
+      pix->b = x + min;
+      break;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 10000;
+  int h, s, v, i, f, failed = 0;
+  double start, elapsed;
+
+  // Every colour, 256 hues at a time.  The spans start at odd offsets and
+  // have odd lengths so that the scalar tails are checked too.
+  for (s = 0; s < 256 && !failed; s++) {
+    for (v = 0; v < 256 && !failed; v++) {
+      for (h = 0; h < 256; h++) {
+        hue[h] = h;
+        sat[h] = s;
+        val[h] = v;
+        switch_hsv_to_rgb(h, s, v, &expected[h]);
+        hsv_to_rgb(h, s, v, &out[h]);
+      }
+      hsv_to_rgb_span(hue, sat, val, out + 256, 256);
+      hsv_to_rgb_span(hue + 3, sat + 3, val + 3, out + 515, 253 - s % 8);
+      for (h = 0; h < 256; h++) {
+        if (memcmp(&out[h], &expected[h], sizeof(pixel)) ||
+            memcmp(&out[256 + h], &expected[h], sizeof(pixel)) ||
+            (h >= 3 && h < 256 - s % 8 &&
+             memcmp(&out[512 + h], &expected[h], sizeof(pixel)))) {
+          fprintf(stderr, "hsv %d %d %d differs\n", h, s, v);
+          failed = 1;
+          break;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < NUM_PIXELS; i++) {
+    hue[i] = random();
+    sat[i] = random();
+    val[i] = random();
+  }
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    for (i = 0; i < NUM_PIXELS; i++) {
+      switch_hsv_to_rgb(hue[i], sat[i], val[i], &expected[i]);
+    }
+  }
+  elapsed = get_time() - start;
+  printf("%-16s %8.2f us/frame\n", "switch", elapsed*1e6/frames);
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    for (i = 0; i < NUM_PIXELS; i++) {
+      hsv_to_rgb(hue[i], sat[i], val[i], &out[i]);
+    }
+  }
+  elapsed = get_time() - start;
+  printf("%-16s %8.2f us/frame\n", "hsv_to_rgb", elapsed*1e6/frames);
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    hsv_to_rgb_span(hue, sat, val, out, NUM_PIXELS);
+  }
+  elapsed = get_time() - start;
+  printf("%-16s %8.2f us/frame\n", "hsv_to_rgb_span", elapsed*1e6/frames);
+  return failed;
+}
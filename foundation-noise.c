@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "serpent.h"
+#include "colour.h"
 
 #define clamp(x) ((x) < 0 ? 0 : (x) > 255 ? 255 : (x))
 
@@ -242,51 +243,6 @@ void next_plasma(int frame) {
 byte head[HEAD_PIXELS*3];
 byte pixels[NUM_PIXELS*3];
 
-/* hue = 0..254, sat = 0..255, val = 0..255 */
-void hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix) {
-  byte r = 0, g = 0, b = 0, max = 0;
-  byte chr = (val*sat + 255)>>8;
-  byte min = val - chr;
-  byte phase = hue % 85;
-  byte x;
-
-  phase = (phase >= 43) ? 85 - phase : phase;
-  x = ((word) chr * phase*6 + 127) / 255;
-  switch ((hue*2)/85) {
-    case 0:
-    case 6:
-      pix->r = val;
-      pix->g = x + min;
-      pix->b = min;
-      break;
-    case 1:
-      pix->r = x + min;
-      pix->g = val;
-      pix->b = min;
-      break;
-    case 2:
-      pix->r = min;
-      pix->g = val;
-      pix->b = x + min;
-      break;
-    case 3:
-      pix->r = min;
-      pix->g = x + min;
-      pix->b = val;
-      break;
-    case 4:
-      pix->r = x + min;
-      pix->g = min;
-      pix->b = val;
-      break;
-    case 5:
-      pix->r = val;
-      pix->g = min;
-      pix->b = x + min;
-      break;
-  }
-}
-
 int DH_OPTIONS[7] = {-127, -85, -43, 0, 43, 85, 127};
 
 static double h1, s1, v1, dh, s2, v2;
@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include "serpent.h"
+#include "colour.h"
 
 #define clamp(x) ((x) < 0 ? 0 : (x) > 255 ? 255 : (x))
 
@@ -55,51 +56,6 @@ void next_plasma(int frame) {
 byte head[HEAD_PIXELS*3];
 byte pixels[NUM_PIXELS*3];
 
-/* hue = 0..254, sat = 0..255, val = 0..255 */
-void hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix) {
-  byte r = 0, g = 0, b = 0, max = 0;
-  byte chr = (val*sat + 255)>>8;
-  byte min = val - chr;
-  byte phase = hue % 85;
-  byte x;
-
-  phase = (phase >= 43) ? 85 - phase : phase;
-  x = ((word) chr * phase*6 + 127) / 255;
-  switch ((hue*2)/85) {
-    case 0:
-    case 6:
-      pix->r = val;
-      pix->g = x + min;
-      pix->b = min;
-      break;
-    case 1:
-      pix->r = x + min;
-      pix->g = val;
-      pix->b = min;
-      break;
-    case 2:
-      pix->r = min;
-      pix->g = val;
-      pix->b = x + min;
-      break;
-    case 3:
-      pix->r = min;
-      pix->g = x + min;
-      pix->b = val;
-      break;
-    case 4:
-      pix->r = x + min;
-      pix->g = min;
-      pix->b = val;
-      break;
-    case 5:
-      pix->r = val;
-      pix->g = min;
-      pix->b = x + min;
-      break;
-  }
-}
-
 int DH_OPTIONS[7] = {-127, -85, -43, 0, 43, 85, 127};
 
 static double h1, s1, v1, dh, s2, v2;
@@ -174,6 +130,17 @@ void next_frame(int f) {
   if (v < min_v) { min_v = v; }
   hsv_to_rgb(h + 255, s, v, &tp);
 
+  // Every ring gets the same colours, desaturated on one side.
+  byte ring_h[NUM_COLUMNS], ring_s[NUM_COLUMNS], ring_v[NUM_COLUMNS];
+  pixel ring[NUM_COLUMNS];
+  for (int c = 0; c < NUM_COLUMNS; c++) {
+    int sat_bias = -128 * cos(((float) c/NUM_COLUMNS + tilt*0.02) * 2 * M_PI);
+    ring_h[c] = h;
+    ring_s[c] = clamp(s + sat_bias);
+    ring_v[c] = v;
+  }
+  hsv_to_rgb_span(ring_h, ring_s, ring_v, ring, NUM_COLUMNS);
+
   float breath_sin = sin(breath_phase);
   for (int r = 0; r < NUM_ROWS; r++) {
     float breath = (SIN(r*128/NUM_ROWS) - 0.5) * breath_sin * min_v/2;
@@ -195,8 +162,7 @@ void next_frame(int f) {
         bi = bi*(1-pp) + plasma[i*3 + 2]*pp;
       }
       //set_rgb(pixels, i, clamp(ri), clamp(gi), clamp(bi));
-      int sat_bias = -128 * cos(((float) c/NUM_COLUMNS + tilt*0.02) * 2 * M_PI);
-      hsv_to_rgb(h, clamp(s + sat_bias), v, ((pixel*) pixels) + i);
+      ((pixel*) pixels)[i] = ring[c];
     }
   }
   for (int s = 0; s < NUM_SEGS; s++) {
@@ -0,0 +1,72 @@
+#define _POSIX_C_SOURCE 200112L
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include "frame_clock.h"
+
+#define NS_PER_SECOND 1000000000LL
+
+int64_t frame_clock_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec*NS_PER_SECOND + now.tv_nsec;
+}
+
+static int64_t frame_clock_deadline(frame_clock* clock, int64_t n) {
+  return clock->start_ns + n*NS_PER_SECOND/clock->fps;
+}
+
+/* Sleeps until the monotonic clock reaches 'deadline_ns'. */
+static void frame_clock_sleep_until(int64_t deadline_ns) {
+  struct timespec deadline;
+#ifdef __APPLE__
+  /* No clock_nanosleep on Mac OS; sleep for the remaining interval. */
+  int64_t remaining;
+  while ((remaining = deadline_ns - frame_clock_now_ns()) > 0) {
+    deadline.tv_sec = remaining / NS_PER_SECOND;
+    deadline.tv_nsec = remaining % NS_PER_SECOND;
+    nanosleep(&deadline, NULL);
+  }
+#else
+  deadline.tv_sec = deadline_ns / NS_PER_SECOND;
+  deadline.tv_nsec = deadline_ns % NS_PER_SECOND;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+                         &deadline, NULL) == EINTR) { }
+#endif
+}
+
+int frame_clock_rate(char* variable, int default_fps, int max_fps) {
+  char* value = getenv(variable);
+  int fps = value ? atoi(value) : 0;
+  return fps >= 1 && fps <= max_fps ? fps : default_fps;
+}
+
+void frame_clock_init(frame_clock* clock, int fps, int policy) {
+  clock->start_ns = frame_clock_now_ns();
+  clock->next = 1;
+  clock->fps = fps;
+  clock->policy = policy;
+  clock->skipped = 0;
+}
+
+int frame_clock_wait(frame_clock* clock) {
+  int64_t now = frame_clock_now_ns();
+  int64_t late;
+  int skipped = 0;
+
+  if (clock->policy == FRAME_CLOCK_SKIP &&
+      now >= frame_clock_deadline(clock, clock->next + 1)) {
+    /* Realign to the first deadline that is still ahead of us. */
+    late = (now - clock->start_ns)*clock->fps/NS_PER_SECOND + 1;
+    skipped = late - clock->next;
+    clock->skipped += skipped;
+    clock->next = late;
+  }
+  frame_clock_sleep_until(frame_clock_deadline(clock, clock->next));
+  clock->next++;
+  return skipped;
+}
+
+float frame_clock_seconds(frame_clock* clock, int skipped) {
+  return (skipped < clock->fps ? 1 + skipped : 1)/(float) clock->fps;
+}
@@ -0,0 +1,40 @@
+// Frame pacing against a monotonic clock, for the backends' main loops.
+#ifndef FRAME_CLOCK_H
+#define FRAME_CLOCK_H
+
+#include <stdint.h>
+
+/* What to do when a frame ends after the next frame's deadline. */
+#define FRAME_CLOCK_SKIP 0  /* drop missed deadlines; wait for the next one */
+#define FRAME_CLOCK_CATCH_UP 1  /* run late frames back to back */
+
+/* Deadline n is start_ns + n*1e9/fps exactly, so there is no drift from */
+/* rounding the frame period. */
+typedef struct {
+  int64_t start_ns;
+  int64_t next;  /* index of the next deadline */
+  int fps;
+  int policy;
+  int64_t skipped;  /* total deadlines dropped by FRAME_CLOCK_SKIP */
+} frame_clock;
+
+/* Returns the time on the monotonic clock, in nanoseconds. */
+int64_t frame_clock_now_ns();
+
+/* Returns the frame rate set in the given environment variable, or */
+/* default_fps if it is unset or not between 1 and max_fps. */
+int frame_clock_rate(char* variable, int default_fps, int max_fps);
+
+/* Starts a clock whose first deadline is one frame from now. */
+void frame_clock_init(frame_clock* clock, int fps, int policy);
+
+/* Sleeps until the next deadline, then moves on to the one after.  Returns */
+/* the number of deadlines skipped because the caller was late. */
+int frame_clock_wait(frame_clock* clock);
+
+/* Returns the time, in seconds, that a frame stands for, given what */
+/* frame_clock_wait() returned before it.  Skipped deadlines count, unless */
+/* a second or more of them were skipped: that was a stall, not a slow frame. */
+float frame_clock_seconds(frame_clock* clock, int skipped);
+
+#endif  /* FRAME_CLOCK_H */
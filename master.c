@@ -15,6 +15,7 @@
 // limitations under the License.
 
 #define __USE_SVID
+#define _DEFAULT_SOURCE 1
 
 #include <math.h>
 #include <stdio.h>
@@ -27,6 +28,11 @@
 #include "spectrum.pal"
 #include "sunset.pal" 
 #include "midi.h"
+#include "blend.h"
+#include "colour.h"
+#include "parallel.h"
+#include "post_process.h"
+#include "stencil.h"
 
 
 #define SEC FPS  // use this for animation time parameters
@@ -42,95 +48,50 @@
 #define CRYSTAL_COUNT 6
 
 float last_frame = 0;
+unsigned int random_seed = 0;  // nonzero for a repeatable run
 
 // Pixel manipulation ======================================================
 
+// Patterns draw into pixels[] as a plain grid, one row after another.  The
+// wiring runs back and forth, so grid_to_wire() reverses every other row
+// once, on the way out.
+#define grid_index(row, col) ((row)*NUM_COLUMNS + (col))
+
+
 pixel head[HEAD_PIXELS];
 pixel pixels[NUM_PIXELS];
+pixel wire_pixels[NUM_PIXELS];
 pixel spine[NUM_ROWS];
 
-short __i;
-long __alpha;
-long __value;
-
-#define paint_rgb(pixels, i, red, green, blue, alpha) { \
-  __i = i; \
-  __alpha = alpha; \
-  __value = (((long) red)*(__alpha) + (pixels)[__i].r*(256-__alpha)) >> 8; \
-  (pixels)[__i].r = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
-  __value = (((long) green)*(__alpha) + (pixels)[__i].g*(256-__alpha)) >> 8; \
-  (pixels)[__i].g = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
-  __value = (((long) blue)*(__alpha) + (pixels)[__i].b*(256-__alpha)) >> 8; \
-  (pixels)[__i].b = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
-}
-
-#define paint_pixel(pixels, i, pix, alpha) \
-    paint_rgb(pixels, i, (pix).r, (pix).g, (pix).b, alpha)
-
-#define add_to_pixel(pixels, i, red, green, blue, alpha) { \
-  __i = i; \
-  __alpha = alpha; \
-  __value = ((((long) red)*(__alpha)) >> 8) + pixels[__i].r; \
-  pixels[__i].r = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
-  __value = ((((long) green)*(__alpha)) >> 8) + pixels[__i].g; \
-  pixels[__i].g = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
-  __value = ((((long) blue)*(__alpha)) >> 8) + pixels[__i].b; \
-  pixels[__i].b = __value < 0 ? 0 : __value > 255 ? 255 : __value; \
+// From post-processing until output, the frame is kept in 8.8 fixed point,
+// one plane per channel, so it is rounded to bytes only once.  Patterns
+// never see these; they keep painting over their own undimmed pixels.
+uint16_t body16[3][NUM_PIXELS];
+uint16_t spine16[3][NUM_ROWS];
+uint16_t head16[3][HEAD_PIXELS];
+pixel head_out[HEAD_PIXELS];
+pixel spine_out[NUM_ROWS];
+
+// Returns the grid index of the pixel at a given position along the wiring.
+int wire_to_grid(int i) {
+  int row = i / NUM_COLUMNS, col = i % NUM_COLUMNS;
+  return grid_index(row, row % 2 ? NUM_COLUMNS - 1 - col : col);
 }
 
-// sets the colour of a pixel from a palette
-#define paint_from_palette(pixels, pixel_index, palette, f, alpha) { \
-  byte* __s = (palette) + palette_index(palette, f)*3; \
-  paint_rgb(pixels, pixel_index, __s[0], __s[1], __s[2], alpha); \
+void grid_to_wire(const pixel* grid, pixel* wire, int rows) {
+  for (int r = 0; r < rows; r++, grid += NUM_COLUMNS, wire += NUM_COLUMNS) {
+    if (r % 2) {
+      for (int c = 0; c < NUM_COLUMNS; c++) {
+        wire[c] = grid[NUM_COLUMNS - 1 - c];
+      }
+    } else {
+      memcpy(wire, grid, sizeof(pixel)*NUM_COLUMNS);
+    }
+  }
 }
 
 #define clamp(x, min, max) ((x) < (min) ? (min) : (x) > (max) ? (max) : (x))
 
-/* hue = 0..254, sat = 0..255, val = 0..255 */
-void hsv_to_rgb(byte hue, byte sat, byte val, pixel* pix) {
-  byte r = 0, g = 0, b = 0, max = 0;
-  byte chr = (val*sat + 255)>>8;
-  byte min = val - chr;
-  byte phase = hue % 85;
-  byte x;
-
-  phase = (phase >= 43) ? 85 - phase : phase;
-  x = ((unsigned int) chr * phase*6 + 127) / 255;
-  switch ((hue*2)/85) {
-    case 0:
-    case 6:
-      pix->r = val;
-      pix->g = x + min;
-      pix->b = min;
-      break;
-    case 1:
-      pix->r = x + min;
-      pix->g = val;
-      pix->b = min;
-      break;
-    case 2:
-      pix->r = min;
-      pix->g = val;
-      pix->b = x + min;
-      break;
-    case 3:
-      pix->r = min;
-      pix->g = x + min;
-      pix->b = val;
-      break;
-    case 4:
-      pix->r = x + min;
-      pix->g = min;
-      pix->b = val;
-      break;
-    case 5:
-      pix->r = val;
-      pix->g = min;
-      pix->b = x + min;
-      break;
-  }
-}
-
 #define frandom(max) ((random() % 1000000) * 0.000001 * (max))
 #define irandom(max) (random() % (max))
 
@@ -175,17 +136,18 @@ void init_head_pixel_locations() {
 }
 
 void copy_body_to_head(pixel* pixels, pixel* head) {
-  memcpy(head, pixels, sizeof(pixel)*HEAD_PIXELS);
+  grid_to_wire(pixels, head, HEAD_PIXELS/NUM_COLUMNS);
 
   // Give special colour separation to the eyes.
-  pixel* p = (pixel*) pixels;
   for (int i = 0; i < outer_eye_length; i++) {
-    head[left_outer_eye_start + i] = pixels[NUM_PIXELS - 1 - i];
-    head[right_outer_eye_start + i] = pixels[NUM_PIXELS - 1 - i];
+    head[left_outer_eye_start + i] = pixels[wire_to_grid(NUM_PIXELS - 1 - i)];
+    head[right_outer_eye_start + i] = pixels[wire_to_grid(NUM_PIXELS - 1 - i)];
   }
   for (int i = 0; i < inner_eye_length; i++) {
-    head[left_outer_eye_start + outer_eye_length + i] = pixels[i];
-    head[right_outer_eye_start + outer_eye_length + i] = pixels[i];
+    head[left_outer_eye_start + outer_eye_length + i] =
+        pixels[wire_to_grid(i)];
+    head[right_outer_eye_start + outer_eye_length + i] =
+        pixels[wire_to_grid(i)];
   }
 }
 
@@ -220,6 +182,7 @@ struct pattern {
   char* name;
   next_frame_func* next_frame;
   byte time_warp_capable;
+  byte parallel_capable;  // may render blocks of pixels on worker threads
   float frame;
 };
 typedef struct pattern pattern;
@@ -248,9 +211,41 @@ short transition_alpha(
   return 256;
 }
 
+// Pattern time (p->frame) is counted in ticks of 1/FPS second, however fast
+// frames are actually rendered.  A pattern that updates its state in fixed
+// steps asks this how many steps are due between pattern times 'last' and
+// 'now', at 'steps_per_tick' steps per tick.  'last' may be left over from
+// another pattern, so anything implausible (going backward, or more than a
+// second's worth) counts as one step.
+int steps_between(float last, float now, int steps_per_tick) {
+  int steps = (int) floor(now*steps_per_tick) -
+      (int) floor(last*steps_per_tick);
+  return steps < 0 || steps > steps_per_tick*FPS ? now != last : steps;
+}
+
+// Calls func(context, start, end) over all the body pixels, one segment per
+// block.  The blocks run on the worker pool if the pattern is
+// parallel_capable, and are all finished when this returns.
+void parallel_for_pixels(pattern* p, parallel_func* func, void* context) {
+  if (p->parallel_capable) {
+    parallel_for(NUM_PIXELS, NUM_SEGS, func, context);
+  } else {
+    func(context, 0, NUM_PIXELS);
+  }
+}
+
+// What a pattern whose pixels depend only on the frame needs to render a
+// block of them.
+typedef struct {
+  pixel* pixels;
+  float frame;
+  short alpha;
+} pixel_span;
+
+// Use this as "short alpha = get_alpha_or_terminate(...);".
 #define get_alpha_or_terminate(frame, in_period, duration, out_period) \
-  (__alpha = transition_alpha(frame, in_period, duration, out_period)); \
-  if (__alpha < 0) return 0;
+  transition_alpha(frame, in_period, duration, out_period); \
+  if (alpha < 0) return 0;
 
 
 // Null pattern ============================================================
@@ -266,12 +261,11 @@ void base_select_target(pixel* target_pixels) {
   pixel h = {random() % 250 + 5, random() % 250 + 5, random() % 250 + 5};
   pixel t = {random() % 250 + 5, random() % 250 + 5, random() % 250 + 5};
   for (short r = 0; r < NUM_ROWS; r++) {
-    short alpha = (long) r*256/NUM_ROWS;
+    pixel* row = target_pixels + r*NUM_COLUMNS;
     for (short c = 0; c < NUM_COLUMNS; c++) {
-      short i = pixel_index(r, c);
-      set_pixel(target_pixels, i, h);
-      paint_pixel(target_pixels, i, t, alpha);
+      row[c] = h;
     }
+    fill_span(row, t, (long) r*256/NUM_ROWS, NUM_COLUMNS);
   }
 }
 
@@ -293,10 +287,8 @@ byte base_next_frame(pattern* p, pixel* pixels, pixel* head) {
     alpha = 0;
   }
 
-  for (short i = 0; i < NUM_PIXELS; i++) {
-    pixels[i] = source_pixels[i];
-    paint_pixel(pixels, i, target_pixels[i], alpha);
-  }
+  memcpy(pixels, source_pixels, sizeof(pixel)*NUM_PIXELS);
+  blend_span(pixels, target_pixels, alpha, NUM_PIXELS);
 
   return 1;
 }
@@ -305,6 +297,7 @@ byte base_next_frame(pattern* p, pixel* pixels, pixel* head) {
 // "swirl", by Ka-Ping Yee =================================================
 
 #define SWIRL_PALETTE SPECTRUM_PALETTE
+#define SWIRL_PALETTE_SIZE SPECTRUM_PALETTE_SIZE
 
 #define SWIRL_DUTY_CYCLE_ON 120
 #define SWIRL_DUTY_CYCLE_OFF 120
@@ -314,8 +307,13 @@ byte base_next_frame(pattern* p, pixel* pixels, pixel* head) {
 #define SWIRL_SPRING_CONST 400  // kg/s^2
 #define SWIRL_MASS 0.1  // kg
 
-float swirl_position[NUM_ROWS];  // rev
-float swirl_velocity[NUM_ROWS];  // rev/s
+// The swirl is a column of NUM_ROWS masses, each turned by the rows next
+// to it.  Row 0 is driven by hand or by the automatic impulse.
+stencil_grid swirl_grid;
+float swirl_position[STENCIL_FLOATS(NUM_ROWS, 1)];  // rev
+float swirl_velocity[STENCIL_FLOATS(NUM_ROWS, 1)];  // rev/s
+float swirl_push[STENCIL_FLOATS(NUM_ROWS, 1)];
+#define swirl_at(values, row) (*stencil_cell(&swirl_grid, values, row, 0))
 int swirl_auto_impulse = 1;
 float swirl_button_force = 30;
 float swirl_restore_factor = 0;
@@ -325,39 +323,28 @@ float swirl_auto_impulse_amplitude = 0.5;
 
 void swirl_tick(float dt) {
   float friction_force = 0.1; // 05 + read_button('y')*0.2;
-  float friction_min_velocity = friction_force/SWIRL_MASS * dt;
   float spring = midi_get_control(7) / 100.0 + 0.5;
   spring = spring * spring;
   spring = SWIRL_SPRING_CONST * spring * spring;
 
-  for (int i = 0; i < NUM_ROWS; i++) {
-    float force;
-    if (i == 0) {
-      force = accel_right()*0.7 +
-          (read_button('b') - read_button('a'))*swirl_button_force;
-      if (force < -25 || force > 25 || midi_get_control(8) != 64) {
-        swirl_auto_impulse = 0;
-      }
-      if (swirl_auto_impulse) {
-        continue;
-      }
-      swirl_position[i] = (midi_get_control(8) - 64)/80.0;
-    } else {
-      force = spring * (swirl_position[i-1] - swirl_position[i]);
-    }
-    if (i < NUM_ROWS - 1) {
-      force += spring * (swirl_position[i+1] - swirl_position[i]);
-    }
-    force += swirl_restore_factor * (swirl_restore_center - swirl_position[i]);
-    if (swirl_velocity[i] > friction_min_velocity) {
-      force -= friction_force;
-    } else if (swirl_velocity[i] < -friction_min_velocity) {
-      force += friction_force;
-    }
-    swirl_velocity[i] += force/SWIRL_MASS * dt;
+  swirl_grid.spring = spring;
+  swirl_grid.restore = swirl_restore_factor;
+  swirl_grid.centre = swirl_restore_center;
+  swirl_grid.friction = friction_force;
+  swirl_grid.min_velocity = friction_force/SWIRL_MASS * dt;
+
+  float force = accel_right()*0.7 +
+      (read_button('b') - read_button('a'))*swirl_button_force;
+  if (force < -25 || force > 25 || midi_get_control(8) != 64) {
+    swirl_auto_impulse = 0;
   }
-  for (int i = 0; i < NUM_ROWS; i++) {
-    swirl_position[i] += swirl_velocity[i] * dt;
+  if (swirl_auto_impulse) {
+    // Row 0 keeps its velocity; its position is set in swirl_next_frame.
+    stencil_tick(&swirl_grid, dt, 1);
+  } else {
+    swirl_at(swirl_position, 0) = (midi_get_control(8) - 64)/80.0;
+    swirl_at(swirl_push, 0) = force;
+    stencil_tick(&swirl_grid, dt, 0);
   }
 }
 
@@ -369,17 +356,17 @@ byte swirl_next_frame(pattern* p, pixel* pixels, pixel* head) {
     midi_set_control_with_pickup(7, 40);
     midi_set_control_with_pickup(8, 64);
     swirl_auto_impulse = 1;
-    for (int i = 0; i < NUM_ROWS; i++) {
-      swirl_position[i] = 0;
-      swirl_velocity[i] = 0;
-    }
+    stencil_setup(&swirl_grid, NUM_ROWS, 1, 0, swirl_position,
+                  swirl_velocity);
+    swirl_grid.push = swirl_push;
+    swirl_grid.mass = SWIRL_MASS;
   }
 
   if (swirl_auto_impulse) {
     float duty_phase = (x - SWIRL_IMPULSE_START) %
         (SWIRL_DUTY_CYCLE_ON + SWIRL_DUTY_CYCLE_OFF);
     if (x > SWIRL_IMPULSE_START && duty_phase < SWIRL_DUTY_CYCLE_ON) {
-      swirl_position[0] = swirl_auto_impulse_amplitude *
+      swirl_at(swirl_position, 0) = swirl_auto_impulse_amplitude *
           sin(2*M_PI*(duty_phase/swirl_auto_impulse_period));
     } else {
       swirl_auto_impulse_period = (random() % 30) + 30;
@@ -398,26 +385,26 @@ byte swirl_next_frame(pattern* p, pixel* pixels, pixel* head) {
     swirl_restore_factor = 1;
     double sum = 0;
     for (int i = 0; i < NUM_ROWS; i++) {
-      sum += swirl_position[i];
+      sum += swirl_at(swirl_position, i);
     }
     swirl_restore_center = sum / NUM_ROWS;
   }
 
   if (p->frame != last_frame) {
-    int count = SWIRL_TICKS_PER_FRAME*(p->frame - last_frame);
-    if (count < 1) { count = 1; }
+    int count = steps_between(last_frame, p->frame, SWIRL_TICKS_PER_FRAME);
     for (int t = 0; t < count; t++) {
       swirl_tick(1.0/FPS/SWIRL_TICKS_PER_FRAME);
     }
     last_frame = p->frame;
   }
 
+  double f[NUM_COLUMNS];
   for (int i = 0; i < NUM_ROWS; i++) {
     for (int j = 0; j < NUM_COLUMNS; j++) {
-      paint_from_palette(pixels, pixel_index(i, j), SWIRL_PALETTE,
-                         swirl_position[i] + (float) j / NUM_COLUMNS + 0.5,
-                         alpha);
+      f[j] = swirl_at(swirl_position, i) + (float) j / NUM_COLUMNS + 0.5;
     }
+    palette_span(pixels + i*NUM_COLUMNS, SWIRL_PALETTE, SWIRL_PALETTE_SIZE,
+                 f, alpha, NUM_COLUMNS);
   }
 
   copy_body_to_head(pixels, head);
@@ -429,9 +416,11 @@ byte swirl_next_frame(pattern* p, pixel* pixels, pixel* head) {
 
 #define RABBIT_MAX_BRIGHT 255
 
-byte rabbit_sine_next_frame(pattern* p, pixel* pixels, pixel* head) {
-    float frame = p->frame;
-    short alpha = get_alpha_or_terminate(frame, 3*SEC, 2*60*SEC, 3*SEC);
+void rabbit_sine_span(void* context, int start, int end) {
+    pixel_span* span = context;
+    pixel* pixels = span->pixels;
+    float frame = span->frame;
+    short alpha = span->alpha;
 
     int r,g,b,temp;
 
@@ -453,16 +442,12 @@ byte rabbit_sine_next_frame(pattern* p, pixel* pixels, pixel* head) {
     float black_stripe_width = 0.8; // width of black stripe between colors
     
 
-    for (int i = 0; i < 300*NUM_SEGS; i++) {
+    for (int i = start; i < end; i++) {
         //-------------------------------------------
         // RADIAL COORDINATES
         x = (i % NUM_COLUMNS);  // theta.  0 to 24
         y = (i / NUM_COLUMNS);  // along cylinder.  0 to NUM_SEGS*SEG_ROWS (120)
         seg = y / SEG_ROWS;
-        // reverse every other row
-        if (y % 2 == 1) {
-            x = (NUM_COLUMNS-1)-x;
-        }
         
         // rotate 90 degrees to one side
         //x = (x + NUM_COLUMNS/4) % NUM_COLUMNS;
@@ -560,9 +545,16 @@ byte rabbit_sine_next_frame(pattern* p, pixel* pixels, pixel* head) {
         if (g > RABBIT_MAX_BRIGHT) { g = RABBIT_MAX_BRIGHT; }
         if (b < 0) { b = 0; }
         if (b > RABBIT_MAX_BRIGHT) { b = RABBIT_MAX_BRIGHT; }
-        paint_rgb(pixels, i, r, g, b, alpha);
+        blend_rgb(&pixels[i], r, g, b, alpha);
     }
+}
+
+byte rabbit_sine_next_frame(pattern* p, pixel* pixels, pixel* head) {
+    float frame = p->frame;
+    short alpha = get_alpha_or_terminate(frame, 3*SEC, 2*60*SEC, 3*SEC);
+    pixel_span span = {pixels, frame, alpha};
 
+    parallel_for_pixels(p, rabbit_sine_span, &span);
     copy_body_to_head(pixels, head);
     return 1;
 }
@@ -572,10 +564,12 @@ byte rabbit_sine_next_frame(pattern* p, pixel* pixels, pixel* head) {
 
 #define ELECTRIC_LOCI 200
 
+// Every third pixel of row x, counted along the wiring as it always was.
 void electric_draw_locus(int x, int orientation, byte* pixels) {
-  int i;
+  int c, i;
 
-  for(i=(x*25+orientation)*3;i<(x*25+25)*3;i+=9) {
+  for(c=orientation;c<25;c+=3) {
+    i=wire_to_grid(x*25+c)*3;
     pixels[i]=0x80;
     pixels[i+1]=0x00;
     pixels[i+2]=0xff;
@@ -595,16 +589,19 @@ byte electric_next_frame(pattern* p, pixel* pixels, pixel* head) {
 
   short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 2*60*SEC, 3*SEC);
   int frame = p->frame - 4*SEC;
+  int steps = steps_between(last_frame, frame, 1);
 
   for(i=0;i<9000;i++) {
     temp_pixels[i]=0;
   }
 
   if(frame>=0) {
-    if(frame%10==0 && frame != last_frame) {
-      inv_velocity[nnext]=1000/(frame%1000+1);
-      inv_omega[nnext]=333/(frame%333+1);
-      t_not[nnext]=frame;
+    // Start a locus on every tenth tick, even if this frame skipped past it.
+    if(frame%10 < steps) {
+      int start = frame - frame%10;
+      inv_velocity[nnext]=1000/(start%1000+1);
+      inv_omega[nnext]=333/(start%333+1);
+      t_not[nnext]=start;
  
       nnext++;
       if(nnext==ELECTRIC_LOCI) nnext=0;
@@ -628,7 +625,7 @@ byte electric_next_frame(pattern* p, pixel* pixels, pixel* head) {
     byte r = *(t++);
     byte g = *(t++);
     byte b = *(t++);
-    paint_rgb(pixels, i, r, g, b, alpha); 
+    blend_rgb(&pixels[i], r, g, b, alpha); 
   }
 
   copy_body_to_head(pixels, head);
@@ -638,7 +635,8 @@ byte electric_next_frame(pattern* p, pixel* pixels, pixel* head) {
 
 // "squares", by Brian Schantz =============================================
 
-#define SQUARES_NUM_SPRITES 90
+#define SQUARES_NUM_SPRITES 90  // SERPENT_SQUARES overrides, up to the max
+#define SQUARES_MAX_SPRITES 4096
 #define SQUARES_MAX_W 16      // max width (around circ.) of a squares_sprite
 #define SQUARES_MAX_H 24      // max height (length of serpent) of a squares_sprite
 #define SQUARES_MAX_Z 100     // max # of Z-levels (could improve this by making sure no two squares_sprites are on the same Z-level)
@@ -658,16 +656,21 @@ typedef struct {
 } squares_color;
 
 void squares_init_sprites(void);
-squares_sprite* squares_top_sprite(int x, int y);
+void squares_draw_sprites(void);
 void squares_move_sprites(float df);
 
-squares_sprite squares_sprites[SQUARES_NUM_SPRITES];
+squares_sprite squares_sprites[SQUARES_MAX_SPRITES];
+int squares_num_sprites = SQUARES_NUM_SPRITES;
+// For each pixel, the index of the sprite on top (-1 for none) and its z.
+short squares_top[NUM_PIXELS];
+int squares_z[NUM_PIXELS];
 squares_color squares_bg;
 int squares_blinktimer;
 
 byte squares_next_frame(pattern* p, pixel* pixels, pixel* head) {
   short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 2*60*SEC, 3*SEC);
   int frame = p->frame;
+  pixel canvas[NUM_PIXELS];
 
   if (frame == 0 || midi_get_control(14)) {
     squares_init_sprites();
@@ -696,25 +699,25 @@ byte squares_next_frame(pattern* p, pixel* pixels, pixel* head) {
       squares_bg.r = squares_bg.g = squares_bg.b = 0;
       break;
   }
-  if (p->frame != last_frame) {
-    squares_blinktimer--;
-  }
-      
-    for (int i = 0; i < NUM_PIXELS; i++) {
-      int x = (i % NUM_COLUMNS);  // theta.  0 to 24
-        int y = (i / NUM_COLUMNS);  // along cylinder.  0 to NUM_SEGS*SEG_ROWS (120)
-        // reverse every other row
-        if (y % 2 == 1) {
-            x = (NUM_COLUMNS-1)-x;
-        }
+  squares_blinktimer -= steps_between(last_frame, p->frame, 1);
+  if (squares_blinktimer < 0) {
+    squares_blinktimer = 0;
+  }
 
-    squares_sprite* s = squares_top_sprite(x,y);
-    if ( NULL == s ) {
-      paint_rgb(pixels, i, squares_bg.r, squares_bg.g, squares_bg.b, alpha);
+  squares_draw_sprites();
+  for (int i = 0; i < NUM_PIXELS; i++) {
+    if (squares_top[i] < 0) {
+      canvas[i].r = squares_bg.r;
+      canvas[i].g = squares_bg.g;
+      canvas[i].b = squares_bg.b;
     } else {
-      paint_rgb(pixels, i, s->r, s->g, s->b, alpha);
+      squares_sprite* s = &squares_sprites[squares_top[i]];
+      canvas[i].r = s->r;
+      canvas[i].g = s->g;
+      canvas[i].b = s->b;
     }
   }
+  blend_span(pixels, canvas, alpha, NUM_PIXELS);
 
   if (p->frame != last_frame) {
     squares_move_sprites(p->frame - last_frame);
@@ -726,8 +729,13 @@ byte squares_next_frame(pattern* p, pixel* pixels, pixel* head) {
 }
 
 void squares_init_sprites() {
-  srand( time(NULL) );
-  for(int i=0;i<SQUARES_NUM_SPRITES;i++) {
+  char* count = getenv("SERPENT_SQUARES");
+  if (count && atoi(count) > 0) {
+    squares_num_sprites = atoi(count) < SQUARES_MAX_SPRITES ?
+        atoi(count) : SQUARES_MAX_SPRITES;
+  }
+  srand( random_seed ? random_seed : time(NULL) );
+  for(int i=0;i<squares_num_sprites;i++) {
     squares_sprites[i].w = rand()%SQUARES_MAX_W;
     squares_sprites[i].h = rand()%SQUARES_MAX_H;
     squares_sprites[i].z = rand()%SQUARES_MAX_Z;
@@ -745,25 +753,37 @@ void squares_init_sprites() {
   }
 }
 
-squares_sprite* squares_top_sprite(int x, int y) {
-  squares_sprite* current = NULL;
-  // test hit
-  for(int i=0;i<SQUARES_NUM_SPRITES;i++) {
-    squares_sprite* s = &squares_sprites[i];
-    int highest_z = 0;
-    if ( x >= s->x && x < s->x+s->w && y >= s->y && y < s->y+s->h ) {
-      if ( s->z > highest_z ) {
-        current = s;
-        highest_z = s->z;
+// Fills in squares_top[] by drawing each sprite's rectangle into a z
+// buffer.  A pixel at (x, y) is covered if s->x <= x < s->x + s->w and
+// likewise for y; columns wrap around the serpent.  The highest z wins,
+// ties go to the first sprite, and sprites at z = 0 are never drawn.
+void squares_draw_sprites() {
+  for (int i = 0; i < NUM_PIXELS; i++) {
+    squares_top[i] = -1;
+    squares_z[i] = 0;
+  }
+  for (int k = 0; k < squares_num_sprites; k++) {
+    squares_sprite* s = &squares_sprites[k];
+    float right = s->x + s->w, bottom = s->y + s->h;
+    int left = ceil(s->x), top = ceil(s->y);
+    int end_col = ceil(right), end_row = ceil(bottom);
+    if (top < 0) top = 0;
+    if (end_row > NUM_ROWS) end_row = NUM_ROWS;
+    if (end_col > left + NUM_COLUMNS) end_col = left + NUM_COLUMNS;
+    for (int y = top; y < end_row; y++) {
+      for (int x = left; x < end_col; x++) {
+        int i = grid_index(y, (x % NUM_COLUMNS + NUM_COLUMNS) % NUM_COLUMNS);
+        if (s->z > squares_z[i]) {
+          squares_top[i] = k;
+          squares_z[i] = s->z;
+        }
       }
     }
   }
-  
-  return current;
 }
 
 void squares_move_sprites(float df) {
-  for(int i=0;i<SQUARES_NUM_SPRITES;i++) {
+  for(int i=0;i<squares_num_sprites;i++) {
     squares_sprite* s = &squares_sprites[i];
     s->x += s->dx*df;
     s->y += s->dy*df;
@@ -789,24 +809,22 @@ void squares_move_sprites(float df) {
 
 // "plasma", by Ka-Ping Yee ================================================
 
-byte plasma_next_frame(pattern* p, pixel* pixels, pixel* head) {
-  short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 2*60*SEC, 3*SEC);
-  float f = p->frame * 0.4;
+typedef struct {
+  pixel_span span;
+  float target_altitude;
+  float spread;
+} plasma_span;
+
+void plasma_render_span(void* context, int start, int end) {
+  plasma_span* plasma = context;
+  pixel* pixels = plasma->span.pixels;
+  short alpha = plasma->span.alpha;
+  float f = plasma->span.frame * 0.4;
   float filter = 1.0;
-  float target_altitude = -100;
-  float spread = 1;
-
-  if (p->frame == 0) {
-    midi_set_control_with_pickup(7, 64);
-    midi_set_control_with_pickup(8, 0);
-  }
-
-  if (midi_get_control(8) > 0) {
-    spread = midi_get_control_exp(7, 0.1, 1.6);
-    target_altitude = midi_get_control_linear(8, -3, 3);
-  }
+  float target_altitude = plasma->target_altitude;
+  float spread = plasma->spread;
 
-  for (int r = 0; r < NUM_ROWS; r++) {
+  for (int r = start/NUM_COLUMNS; r < end/NUM_COLUMNS; r++) {
     for (int c = 0; c < NUM_COLUMNS; c++) {
       float altitude =
           SIN((r*0.7 - c + f*2)*2.9) +
@@ -816,14 +834,30 @@ byte plasma_next_frame(pattern* p, pixel* pixels, pixel* head) {
       if (target_altitude > -100) {
         filter = 1 - fabs(altitude - target_altitude)/spread;
         if (filter < 0) filter = 0;
-        paint_rgb(pixels, pixel_index(r, c), 0, 0, 0, alpha);
+        blend_rgb(&pixels[grid_index(r, c)], 0, 0, 0, alpha);
       }
-      paint_from_palette(
-          pixels, pixel_index(r, c), SPECTRUM_PALETTE,
+      blend_palette(
+          &pixels[grid_index(r, c)], SPECTRUM_PALETTE, SPECTRUM_PALETTE_SIZE,
           0.5 + altitude*0.3, alpha*filter);
     }
   }
+}
+
+byte plasma_next_frame(pattern* p, pixel* pixels, pixel* head) {
+  short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 2*60*SEC, 3*SEC);
+  plasma_span plasma = {{pixels, p->frame, alpha}, -100, 1};
+
+  if (p->frame == 0) {
+    midi_set_control_with_pickup(7, 64);
+    midi_set_control_with_pickup(8, 0);
+  }
 
+  if (midi_get_control(8) > 0) {
+    plasma.spread = midi_get_control_exp(7, 0.1, 1.6);
+    plasma.target_altitude = midi_get_control_linear(8, -3, 3);
+  }
+
+  parallel_for_pixels(p, plasma_render_span, &plasma);
   copy_body_to_head(pixels, head);
   return 1;
 }
@@ -840,25 +874,22 @@ byte ripple_next_frame(pattern* p, pixel* pixels, pixel* head) {
   static unsigned char red[RIPPLES];
   static unsigned char green[RIPPLES];
   static unsigned char blue[RIPPLES];
-  static byte temp_pixels[NUM_PIXELS*3];
+  static pixel rings[NUM_PIXELS];
 
   static int nnext=0;
   static int nmax=0;
   int i,j,k;
-  int distance;
   int rmin;
   int rmax;
-  int pixnum;
 
   short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 2*60*SEC, 3*SEC);
   int frame = p->frame - 3*SEC;
+  int steps = steps_between(last_frame, frame, 1);
 
-  for(i=0;i<9000;i++) {
-    temp_pixels[i]=0;
-  }
+  bzero(rings, sizeof(rings));
 
   if(frame>=0) {
-    if(frame%32==0 && frame != last_frame) {
+    if(frame%32 < steps) {
       red[nnext]=rand()%100+26;
       green[nnext]=rand()%100+26;
       blue[nnext]=rand()%100+26;
@@ -874,7 +905,7 @@ byte ripple_next_frame(pattern* p, pixel* pixels, pixel* head) {
       }
     }
  
-    if (frame != last_frame) {
+    for (j = 0; j < steps; j++) {
       for(i=0;i<nmax;i++) {
         radius[i]+=1;
         red[i]=red[i]*49/50;
@@ -895,47 +926,15 @@ byte ripple_next_frame(pattern* p, pixel* pixels, pixel* head) {
         rmax*=rmax;
       }
  
-      for(j=0;j<125;j++) {
-        for(i=0;i<120;i++) {
-          distance = (posx[k]-i)*(posx[k]-i)+(posy[k]-j)*(posy[k]-j);
-          if(distance>=rmin && distance<=rmax) {
-            pixnum = pixel_index(i,j%25)*3;
-            if(255-temp_pixels[pixnum]<red[k]) {
-             temp_pixels[pixnum]=255;
-            }
-            else {
-              temp_pixels[pixnum]+=red[k];
-            }
-            pixnum++;
- 
-            if(255-temp_pixels[pixnum]<green[k]) {
-             temp_pixels[pixnum]=255;
-            }
-            else {
-              temp_pixels[pixnum]+=green[k];
-            }
-            pixnum++;
- 
- 
-            if(255-temp_pixels[pixnum]<blue[k]) {
-             temp_pixels[pixnum]=255;
-            }
-            else {
-              temp_pixels[pixnum]+=blue[k];
-            }
-          }
-        }
-      }
+      // The rings are centred in columns 50..74 of 125, so they reach
+      // round the serpent more than once as they grow.
+      pixel colour = {red[k], green[k], blue[k]};
+      add_ring(rings, NUM_ROWS, NUM_COLUMNS, 5*NUM_COLUMNS, posx[k], posy[k],
+               rmin, rmax, colour);
     }
   }
 
-  byte* t = temp_pixels;
-  for(i=0;i<NUM_PIXELS;i++) {
-    byte r = *(t++);
-    byte g = *(t++);
-    byte b = *(t++);
-    paint_rgb(pixels, i, r, g, b, alpha); 
-  }
+  blend_span(pixels, rings, alpha, NUM_PIXELS);
 
   last_frame = frame;
 
@@ -956,9 +955,11 @@ float min(float a, float b) {
     return b;
 }
 
-byte rabbit_rainbow_twist_next_frame(pattern* p, pixel* pixels, pixel* head) {
-    float frame = p->frame;
-    short alpha = get_alpha_or_terminate(frame, 3*SEC, 3*60*SEC, 3*SEC);
+void rabbit_rainbow_twist_span(void* context, int start, int end) {
+    pixel_span* span = context;
+    pixel* pixels = span->pixels;
+    float frame = span->frame;
+    short alpha = span->alpha;
 
     // coordinates
     int x,y;         // x is around, y is along
@@ -1013,15 +1014,12 @@ byte rabbit_rainbow_twist_next_frame(pattern* p, pixel* pixels, pixel* head) {
     twirl2 = sin(frame*0.01 + 0.123) * 0.22 + 0.25;
     twirl2 /= NUM_COLUMNS;
 
-    for (int i = 0; i < NUM_PIXELS; i++) {
+    for (int i = start; i < end; i++) {
         //-------------------------------------------
         // RADIAL COORDINATES
         x = (i % NUM_COLUMNS);  // theta.  0 to 24
         y = (i / NUM_COLUMNS);  // along cylinder.  0 to NUM_SEGS*NUM_ROWS (120)
         seg = y / SEG_ROWS;
-        if (y % 2 == 1) {
-            x = (NUM_COLUMNS-1)-x;  // reverse every other row
-        }
 
         twisted_x = (int)(x + y*twist) % NUM_COLUMNS;
         is_on_bottom = (twisted_x < NUM_COLUMNS/2);
@@ -1103,9 +1101,16 @@ byte rabbit_rainbow_twist_next_frame(pattern* p, pixel* pixels, pixel* head) {
         if (b < 0) { b = 0; }
         if (b > RABBIT_MAX_BRIGHT) { b = RABBIT_MAX_BRIGHT; }
 
-        paint_rgb(pixels, i, r, g, b, alpha);
+        blend_rgb(&pixels[i], r, g, b, alpha);
     }
+}
 
+byte rabbit_rainbow_twist_next_frame(pattern* p, pixel* pixels, pixel* head) {
+    float frame = p->frame;
+    short alpha = get_alpha_or_terminate(frame, 3*SEC, 3*60*SEC, 3*SEC);
+    pixel_span span = {pixels, frame, alpha};
+
+    parallel_for_pixels(p, rabbit_rainbow_twist_span, &span);
     copy_body_to_head(pixels, head);
     return 1;
 }
@@ -1120,41 +1125,15 @@ byte rabbit_rainbow_twist_next_frame(pattern* p, pixel* pixels, pixel* head) {
 #define POND_DUTY_CYCLE_PERIOD 10.0
 #define POND_TIME_SPEEDUP 2
 
-float pond_position[NUM_ROWS][NUM_COLUMNS];
-float pond_velocity[NUM_ROWS][NUM_COLUMNS];
+// The pond's surface is a grid of masses on springs, wrapped around the
+// serpent and held at zero along the first and last rows.
+stencil_grid pond_grid;
+float pond_position[STENCIL_FLOATS(NUM_ROWS, NUM_COLUMNS)];
+float pond_velocity[STENCIL_FLOATS(NUM_ROWS, NUM_COLUMNS)];
+#define pond_at(values, row, col) (*stencil_cell(&pond_grid, values, row, col))
 #define POND_MASS 1  // kg
 #define POND_SPRING_CONSTANT 300  // N/m
 
-void pond_tick(float dt) {
-  for (int i = 0; i < NUM_ROWS; i++) {
-    for (int j = 0; j < NUM_COLUMNS; j++) {
-      float delta =
-          (pond_position[i][(j + 1) % NUM_COLUMNS] - pond_position[i][j]) +
-          (pond_position[i][(j + NUM_COLUMNS - 1) % NUM_COLUMNS] -
-              pond_position[i][j]);
-      if (i > 0) {
-        delta += (pond_position[i - 1][j] - pond_position[i][j]);
-      }
-      if (i < NUM_ROWS - 1) {
-        delta += (pond_position[i + 1][j] - pond_position[i][j]);
-      }
-      delta += -pond_position[i][j]*0.02;
-      float force = POND_SPRING_CONSTANT * delta;
-      if (pond_velocity[i][j] > POND_FRICTION_MIN_VELOCITY) {
-        force -= POND_FRICTION_FORCE;
-      } else if (pond_velocity[i][j] < -POND_FRICTION_MIN_VELOCITY) {
-        force += POND_FRICTION_FORCE;
-      }
-      pond_velocity[i][j] += force/POND_MASS * dt;
-    }
-  }
-  for (int i = 0; i < NUM_ROWS; i++) {
-    for (int j = 0; j < NUM_COLUMNS; j++) {
-      pond_position[i][j] += pond_velocity[i][j] * dt;
-    }
-  }
-}
-
 int pond_drop_x, pond_drop_y, pond_last_on = 0;
 float pond_drop_impulse = 2000/POND_MASS;
 #define POND_ENV_MAP_SIZE 800
@@ -1191,15 +1170,16 @@ byte pond_next_frame(pattern* p, pixel* pixels, pixel* head) {
       *(p++) = gg < 0 ? 0 : gg > 255 ? 255 : gg;
       *(p++) = bb < 0 ? 0 : bb > 255 ? 255 : bb;
     }
-    for (int i = 0; i < NUM_ROWS; i++) {
-      for (int j = 0; j < NUM_COLUMNS; j++) {
-        pond_position[i][j] = 0;
-        pond_velocity[i][j] = 0;
-      }
-    }
+    stencil_setup(&pond_grid, NUM_ROWS, NUM_COLUMNS, 1, pond_position,
+                  pond_velocity);
+    pond_grid.spring = POND_SPRING_CONSTANT;
+    pond_grid.anchor = 0.02;
+    pond_grid.friction = POND_FRICTION_FORCE;
+    pond_grid.min_velocity = POND_FRICTION_MIN_VELOCITY;
+    pond_grid.mass = POND_MASS;
   }
 
-  if (p->frame != last_frame) {
+  for (int step = steps_between(last_frame, p->frame, 1); step > 0; step--) {
     float duty_phase =
         t - ((int) (t / POND_DUTY_CYCLE_PERIOD) * POND_DUTY_CYCLE_PERIOD);
     if (duty_phase >= 0 && duty_phase < POND_DUTY_CYCLE_ON && f > 5*SEC) {
@@ -1209,33 +1189,37 @@ byte pond_next_frame(pattern* p, pixel* pixels, pixel* head) {
         pond_drop_impulse = -pond_drop_impulse;
       }
       float k = sin(duty_phase/POND_DUTY_CYCLE_ON*M_PI);
-      pond_velocity[pond_drop_x][pond_drop_y] += pond_drop_impulse*k;
-      pond_velocity[pond_drop_x][(pond_drop_y + 1) % NUM_COLUMNS] +=
+      pond_at(pond_velocity, pond_drop_x, pond_drop_y) += pond_drop_impulse*k;
+      pond_at(pond_velocity, pond_drop_x, (pond_drop_y + 1) % NUM_COLUMNS) +=
           pond_drop_impulse*k;
-      pond_velocity[pond_drop_x + 1][pond_drop_y] += pond_drop_impulse*k;
-      pond_velocity[pond_drop_x + 1][(pond_drop_y + 1) % NUM_COLUMNS] +=
+      pond_at(pond_velocity, pond_drop_x + 1, pond_drop_y) +=
           pond_drop_impulse*k;
+      pond_at(pond_velocity, pond_drop_x + 1,
+              (pond_drop_y + 1) % NUM_COLUMNS) += pond_drop_impulse*k;
       pond_last_on = 1;
     } else {
       pond_last_on = 0;
     }
     for (int j = 0; j < NUM_COLUMNS; j++) {
-      pond_position[0][j] = 0;
-      pond_position[NUM_ROWS - 1][j] = 0;
+      pond_at(pond_position, 0, j) = 0;
+      pond_at(pond_position, NUM_ROWS - 1, j) = 0;
     }
     for (int t = 0; t < POND_TICKS_PER_FRAME; t++) {
-      pond_tick(POND_TIME_SPEEDUP * 1.0/FPS/POND_TICKS_PER_FRAME);
+      stencil_tick(&pond_grid, POND_TIME_SPEEDUP * 1.0/FPS/POND_TICKS_PER_FRAME,
+                   0);
     }
   }
 
   for (int i = 0; i < NUM_ROWS; i++) {
     for (int j = 0; j < NUM_COLUMNS; j++) {
-      int e = (pond_position[i][j]-pond_position[i+1][j])*400 +
+      // The last row is compared with the ghost row below it.
+      int e = (pond_at(pond_position, i, j) -
+               pond_at(pond_position, i + 1, j))*400 +
           POND_ENV_MAP_SIZE*0.35;
       e = (e < 0) ? 0 : (e > POND_ENV_MAP_SIZE - 1) ?
           POND_ENV_MAP_SIZE - 1 : e;
       unsigned char* ep = POND_ENV_MAP + e*3;
-      paint_rgb(pixels, i*NUM_COLUMNS + ((i % 2) ? (NUM_COLUMNS-1-j) : j),
+      blend_rgb(&pixels[grid_index(i, j)],
                 ep[0]*200/255, ep[1]*240/255, ep[2]*240/255, alpha);
     }
   }
@@ -1252,15 +1236,20 @@ byte pond_next_frame(pattern* p, pixel* pixels, pixel* head) {
 #define TWINKLE_MAX_STARS 10000
 int twinkle_num_stars = 0;
 float twinkle_last_frame = 0;
-typedef struct {
-  int index;
-  pixel color;
-  byte value;
-  float magnitude;
-  float target;
-  float ttl;
-} twinkle_star;
-twinkle_star twinkle_stars[TWINKLE_MAX_STARS];
+// The stars are kept as parallel arrays, so the loops that run over all of
+// them every frame work on plain floats and can be vectorized.  A star
+// shines at value^magnitude, worked out as 2^(magnitude*log2(value)).
+int twinkle_index[TWINKLE_MAX_STARS];
+pixel twinkle_color[TWINKLE_MAX_STARS];
+float twinkle_value[TWINKLE_MAX_STARS];
+float twinkle_log_value[TWINKLE_MAX_STARS];
+float twinkle_magnitude[TWINKLE_MAX_STARS];
+float twinkle_target[TWINKLE_MAX_STARS];
+float twinkle_ttl[TWINKLE_MAX_STARS];
+short twinkle_level[TWINKLE_MAX_STARS];
+// Each frame's starlight is summed here, so stars on the same pixel add up.
+unsigned int twinkle_light[3][NUM_PIXELS];
+unsigned int twinkle_seed = 1;
 
 #define TWINKLE_MAX_METEORITES 100
 int twinkle_num_meteorites = 0;
@@ -1302,29 +1291,51 @@ int twinkle_advance_meteorite(twinkle_meteorite* meteorite, float dt) {
   return keep;
 }
 
+// A xorshift generator for the per-frame twinkling, which needs a random
+// number for every star whose twinkle runs out.
+float twinkle_random(float max) {
+  twinkle_seed ^= twinkle_seed << 13;
+  twinkle_seed ^= twinkle_seed >> 17;
+  twinkle_seed ^= twinkle_seed << 5;
+  return (twinkle_seed >> 8)*(1.0f/(1 << 24))*max;
+}
+
+// 2^x for x >= 0, to within 0.015%.
+float twinkle_exp2(float x) {
+  int whole = x;
+  float f = x - whole;
+  int bits = (whole + 127) << 23;
+  float scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return scale*(1 + f*(0.69606564f + f*(0.22449434f + f*0.07944023f)));
+}
+
 void twinkle_add_star() {
-  twinkle_star* star;
+  byte value;
+  int i;
   if (twinkle_num_stars < TWINKLE_MAX_STARS) {
-    star = &twinkle_stars[twinkle_num_stars++];
+    i = twinkle_num_stars++;
     if (twinkle_num_stars <= 2) {
-      star->index = SEG_PIXELS*9 + TAIL_LANTERN_START +
-                    (random() % TAIL_LANTERN_COUNT);
-      star->value = 100 + 100 / (1.0 + frandom(30)*frandom(30));
+      twinkle_index[i] = wire_to_grid(SEG_PIXELS*9 + TAIL_LANTERN_START +
+                                      (random() % TAIL_LANTERN_COUNT));
+      value = 100 + 100 / (1.0 + frandom(30)*frandom(30));
     } else if (twinkle_num_stars <= 4) {
-      star->index = CRYSTAL_START + (random() % CRYSTAL_COUNT);
-      star->value = 100 + 100 / (1.0 + frandom(30)*frandom(30));
+      twinkle_index[i] = wire_to_grid(CRYSTAL_START +
+                                      (random() % CRYSTAL_COUNT));
+      value = 100 + 100 / (1.0 + frandom(30)*frandom(30));
     } else {
-      star->index = random() % NUM_PIXELS;
-      star->value = 1 + 200 / (1.0 + frandom(30)*frandom(30));
+      twinkle_index[i] = random() % NUM_PIXELS;
+      value = 1 + 200 / (1.0 + frandom(30)*frandom(30));
     }
-    star->magnitude = 1;
-    hsv_to_rgb(irandom(254), irandom(32), 255, &star->color);
+    twinkle_value[i] = value;
+    twinkle_log_value[i] = log2(value);
+    twinkle_magnitude[i] = 1;
+    hsv_to_rgb(irandom(254), irandom(32), 255, &twinkle_color[i]);
   }
 }
 
 byte twinkle_next_frame(pattern* p, pixel* pixels, pixel* head) {
   short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 5*60*SEC, 3*SEC);
-  twinkle_star* star;
   twinkle_meteorite* meteorite;
   float meteorites_per_second = midi_get_control_exp(7, 0.004, 60);
   int stars_wanted = midi_get_control_exp(8, 8, TWINKLE_MAX_STARS);
@@ -1332,10 +1343,10 @@ byte twinkle_next_frame(pattern* p, pixel* pixels, pixel* head) {
   float twinkle_time = midi_get_control_exp(24, 1, 0.01);
   float dt = (p->frame - twinkle_last_frame)/FPS;
   pixel canvas[NUM_PIXELS];
-  int i, j, level;
-  pixel* pix;
+  int i, j, level, v;
 
   if (p->frame == 0) {
+    twinkle_seed = random() | 1;
     midi_set_control_with_pickup(6, 32);  // turn off fins
     midi_set_control_with_pickup(7, 40);
     midi_set_control_with_pickup(8, 80);
@@ -1350,13 +1361,17 @@ byte twinkle_next_frame(pattern* p, pixel* pixels, pixel* head) {
 
   float fade = pow(0.5, dt/twinkle_time);
   for (i = 0; i < twinkle_num_stars; i++) {
-    star = &twinkle_stars[i];
-    star->ttl -= dt;
-    if (star->ttl <= 0) {
-      star->target = 1 - frandom(twinkle_amplitude);
-      star->ttl = twinkle_time*(1 - frandom(0.5));
+    twinkle_ttl[i] -= dt;
+    if (twinkle_ttl[i] <= 0) {
+      twinkle_target[i] = 1 - twinkle_random(twinkle_amplitude);
+      twinkle_ttl[i] = twinkle_time*(1 - twinkle_random(0.5));
     }
-    star->magnitude = star->magnitude*fade + star->target*(1 - fade);
+  }
+  for (i = 0; i < twinkle_num_stars; i++) {
+    twinkle_magnitude[i] =
+        twinkle_magnitude[i]*fade + twinkle_target[i]*(1 - fade);
+    float level = twinkle_exp2(twinkle_magnitude[i]*twinkle_log_value[i]);
+    twinkle_level[i] = twinkle_value[i] < 10 ? twinkle_value[i] : level;
   }
 
   if (frandom(1) < meteorites_per_second*dt) {
@@ -1371,23 +1386,30 @@ byte twinkle_next_frame(pattern* p, pixel* pixels, pixel* head) {
   }
   twinkle_num_meteorites = j;
 
-  bzero(canvas, sizeof(pixel)*NUM_PIXELS);
+  bzero(twinkle_light, sizeof(twinkle_light));
   for (i = 0; i < twinkle_num_stars; i++) {
-    star = &twinkle_stars[i];
-    level = star->value < 10 ? star->value : pow(star->value, star->magnitude);
-    paint_rgb(canvas, star->index,
-              star->color.r, star->color.g, star->color.b, level);
+    j = twinkle_index[i];
+    level = twinkle_level[i];
+    twinkle_light[0][j] += twinkle_color[i].r*level;
+    twinkle_light[1][j] += twinkle_color[i].g*level;
+    twinkle_light[2][j] += twinkle_color[i].b*level;
+  }
+  for (i = 0; i < NUM_PIXELS; i++) {
+    v = twinkle_light[0][i] >> 8;
+    canvas[i].r = v > 255 ? 255 : v;
+    v = twinkle_light[1][i] >> 8;
+    canvas[i].g = v > 255 ? 255 : v;
+    v = twinkle_light[2][i] >> 8;
+    canvas[i].b = v > 255 ? 255 : v;
   }
   for (i = 0; i < twinkle_num_meteorites; i++) {
     meteorite = &twinkle_meteorites[i];
     for (j = 0; j < NUM_ROWS; j++) {
       level = clamp(meteorite->levels[j], 0, 256);
-      paint_rgb(canvas, pixel_index(j, meteorite->c), 255, 255, 255, level);
+      blend_rgb(&canvas[grid_index(j, meteorite->c)], 255, 255, 255, level);
     }
   }
-  for (i = 0, pix = canvas; i < NUM_PIXELS; i++, pix++) {
-    paint_rgb(pixels, i, pix->r, pix->g, pix->b, alpha);
-  }
+  blend_span(pixels, canvas, alpha, NUM_PIXELS);
 
   twinkle_last_frame = p->frame;
 
@@ -1400,7 +1422,7 @@ byte twinkle_next_frame(pattern* p, pixel* pixels, pixel* head) {
         in_interval(i, right_outer_eye_start, outer_eye_length) ||
         in_interval(i, left_medallion_start, medallion_length) ||
         in_interval(i, right_medallion_start, medallion_length)) {
-      paint_rgb(head, i, gold.r, gold.g, gold.b, alpha);
+      blend_rgb(&head[i], gold.r, gold.g, gold.b, alpha);
     }
   }
 
@@ -1491,9 +1513,9 @@ void fire_set_pixels(int count, int* levels,
 byte fire_next_frame(pattern* p, pixel* pixels, pixel* head) {
   static pixel fire_pixels[FIRE_NUM_PIXELS];
   short alpha = get_alpha_or_terminate(p->frame, 3*SEC, 5*60*SEC, 3*SEC);
-  pixel* pix;
-  int i, r, c;
+  int i, r;
   static int last_dim = 0;
+  static float fire_last_frame = 0;
   pixel c0 = {20, 0, 0};
   pixel c1 = {200, 20, 0};
   pixel c2 = {40, 140, 0};
@@ -1503,6 +1525,7 @@ byte fire_next_frame(pattern* p, pixel* pixels, pixel* head) {
     midi_set_control_with_pickup(25, last_dim = midi_get_control(1));
 
     fire_setup(FIRE_NUM_PIXELS, fire_levels);
+    fire_last_frame = -1;  // so the first frame takes a step
     midi_set_control_with_pickup(6, 96);
 
     midi_set_control_with_pickup(7, 0x3c);
@@ -1533,15 +1556,15 @@ byte fire_next_frame(pattern* p, pixel* pixels, pixel* head) {
            midi_get_control(30), midi_get_control(31), midi_get_control(32));
   }
 
-  fire_blur(FIRE_NUM_PIXELS, fire_levels, fire_next_levels);
-  fire_pop(FIRE_NUM_PIXELS, fire_levels, midi_get_control_exp(8, 4, 400),
-           midi_get_control_exp(7, 7, 700), 200*FIRE_NUM_PIXELS);
+  for (i = steps_between(fire_last_frame, p->frame, 1); i > 0; i--) {
+    fire_blur(FIRE_NUM_PIXELS, fire_levels, fire_next_levels);
+    fire_pop(FIRE_NUM_PIXELS, fire_levels, midi_get_control_exp(8, 4, 400),
+             midi_get_control_exp(7, 7, 700), 200*FIRE_NUM_PIXELS);
+  }
+  fire_last_frame = p->frame;
   fire_set_pixels(FIRE_NUM_PIXELS, fire_levels, c0, c1, c2, c3, fire_pixels);
   for (r = 0; r < NUM_ROWS; r++) {
-    pix = &fire_pixels[r];
-    for (c = 0; c < NUM_COLUMNS; c++) {
-      paint_rgb(pixels, pixel_index(r, c), pix->r, pix->g, pix->b, alpha);
-    }
+    fill_span(pixels + r*NUM_COLUMNS, fire_pixels[r], alpha, NUM_COLUMNS);
   }
 
   copy_body_to_head(pixels, head);
@@ -1551,7 +1574,7 @@ byte fire_next_frame(pattern* p, pixel* pixels, pixel* head) {
   hsv_to_rgb(7, 255, 32, &gold);
   for (i = TAIL_LANTERN_START; i < TAIL_LANTERN_COUNT; i++) {
     pixels[SEG_PIXELS*9 + i] = black;
-    paint_rgb(pixels + SEG_PIXELS*9, i, gold.r, gold.g, gold.b, alpha);
+    blend_rgb(&(pixels + SEG_PIXELS*9)[i], gold.r, gold.g, gold.b, alpha);
   }
 
   return 1;
@@ -1643,17 +1666,22 @@ byte diner_next_frame(pattern* p, pixel* pixels, pixel* head) {
         in_interval(i, right_medallion_start, medallion_length)) {
       t = s.medallion;
     }
-    paint_rgb(head, i, tint[t].r, tint[t].g, tint[t].b,
+    blend_rgb(&head[i], tint[t].r, tint[t].g, tint[t].b,
               tint_alpha[t]*alpha/255);
   }
 
   bzero(pixels, sizeof(pixel)*NUM_PIXELS);
-  for (i = 0; i < NUM_PIXELS; i++) {
-    t = ((i / SEG_PIXELS) % 2) ? s.body2 : s.body1;
-    if (in_interval(i, SEG_PIXELS*9 + TAIL_LANTERN_START, TAIL_LANTERN_COUNT)) {
-      t = s.lantern;
-    }
-    paint_rgb(pixels, i, tint[t].r, tint[t].g, tint[t].b,
+  for (i = 0; i < NUM_SEGS; i++) {
+    t = (i % 2) ? s.body2 : s.body1;
+    fill_span(pixels + i*SEG_PIXELS, tint[t], tint_alpha[t]*alpha/255,
+              SEG_PIXELS);
+  }
+  t = s.lantern;
+  for (i = 0; i < TAIL_LANTERN_COUNT; i++) {
+    pixel* lantern =
+        &pixels[wire_to_grid(SEG_PIXELS*9 + TAIL_LANTERN_START + i)];
+    lantern->r = lantern->g = lantern->b = 0;
+    blend_rgb(lantern, tint[t].r, tint[t].g, tint[t].b,
               tint_alpha[t]*alpha/255);
   }
 
@@ -1666,18 +1694,18 @@ pattern BASE_PATTERN = {"base", base_next_frame, 0};
 
 #define NUM_PATTERNS 12
 pattern PATTERNS[] = {
-  {"pond", pond_next_frame, 0, 0},
-  {"rabbit-sine", rabbit_sine_next_frame, 1, 0},
-  {"rabbit-rainbow-twist", rabbit_rainbow_twist_next_frame, 1, 0},
-  {"plasma", plasma_next_frame, 1, 0},
-  {"electric", electric_next_frame, 0, 0},
-  {"ripple", ripple_next_frame, 0, 0},
-  {"squares", squares_next_frame, 1, 0},
-  {"swirl", swirl_next_frame, 1, 0},
-  {"twinkle", twinkle_next_frame, 0, 0},
-  {"fire", fire_next_frame, 0, 0},
-  {"diner", diner_next_frame, 0, 0},
-  {"diner", diner_next_frame, 0, 0},
+  {"pond", pond_next_frame, 0, 0, 0},
+  {"rabbit-sine", rabbit_sine_next_frame, 1, 1, 0},
+  {"rabbit-rainbow-twist", rabbit_rainbow_twist_next_frame, 1, 1, 0},
+  {"plasma", plasma_next_frame, 1, 1, 0},
+  {"electric", electric_next_frame, 0, 0, 0},
+  {"ripple", ripple_next_frame, 0, 0, 0},
+  {"squares", squares_next_frame, 1, 0, 0},
+  {"swirl", swirl_next_frame, 1, 0, 0},
+  {"twinkle", twinkle_next_frame, 0, 0, 0},
+  {"fire", fire_next_frame, 0, 0, 0},
+  {"diner", diner_next_frame, 0, 0, 0},
+  {"diner", diner_next_frame, 0, 0, 0},
 };
 
 
@@ -1724,14 +1752,39 @@ void activate_pattern(pattern* p) {
   curp->frame = 0;
 }
 
+// For serpent_bench: run one pattern at a time, from a known random state.
+
+int get_num_patterns() {
+  return NUM_PATTERNS;
+}
+
+const char* get_pattern_name(int i) {
+  return PATTERNS[i].name;
+}
+
+// Switches to pattern i at once, without the fade or the announcement.
+void select_pattern(int i) {
+  next_pattern_override_start = -1;
+  curp = PATTERNS + i;
+  curp->frame = 0;
+}
+
+void seed_random(unsigned int seed) {
+  random_seed = seed;
+  srand(seed);
+  srandom(seed);
+}
+
 void next_frame(int frame) {
-  static long time_to_next_pattern = 5*SEC;
+  static float time_to_next_pattern = 5*SEC;
   static int current_pattern = -1;
   static int requested_pattern = 0;
   static int next_pattern = 0;
-  static int red_thing = -10;
+  static float red_thing = -10;
   static float pulses[5] = {0, 0, 0, 0, 0};
   static int pulse_mode = 0;
+  static float ticks = 0;  // pattern time since the start, as below
+  float dt = get_frame_seconds()*FPS;  // ticks of pattern time in this frame
   int i, r, c;
 
   if (frame == 0) {
@@ -1767,16 +1820,16 @@ void next_frame(int frame) {
         }
       }
       if (midi_get_control(5) > 0) {
-        curp->frame += frame_rate;
+        curp->frame += frame_rate*dt;
       }
     } else {
       printf("\nfinished %s\n", curp->name);
       curp = NULL;
     }
   } else {
-    if (time_to_next_pattern) {
+    if (time_to_next_pattern > 0) {
       midi_show_pattern(-1);
-      time_to_next_pattern--;
+      time_to_next_pattern -= dt;
     } else {
       activate_pattern(PATTERNS + next_pattern);
       current_pattern = next_pattern;
@@ -1785,7 +1838,8 @@ void next_frame(int frame) {
           /*(next_pattern + (random() % (NUM_PATTERNS - 1))) % NUM_PATTERNS;*/
     }
   }
-  switch ((frame/2) % 8) {
+  ticks += dt;
+  switch (((int) ticks/2) % 8) {
     case 1:
       midi_show_pattern(requested_pattern); break;
     case 0:
@@ -1833,17 +1887,17 @@ void next_frame(int frame) {
     if (midi_get_control(j) > 0) {
       float value = midi_get_control_exp(j, 30, 120);
       if (pulses[i] >= value) {
-        pulses[i] *= 1.05;
+        pulses[i] *= pow(1.05, dt);
       } else pulses[i] = value;
     } else {
-      pulses[i] *= 0.84;
+      pulses[i] *= pow(0.84, dt);
       if (pulses[i] < 0.1) { pulses[i] = 0; }
     }
   }
 
   // Copy away the spine
   for (r = 0; r < NUM_ROWS; r++) {
-    spine[r] = pixels[pixel_index(r, 12)];
+    spine[r] = pixels[grid_index(r, 12)];
   }
 
   float brightness[NUM_ROWS];
@@ -1877,37 +1931,16 @@ void next_frame(int frame) {
     }
   }
   spot_pos = 0;
-  for (int r = 0; r < NUM_ROWS; r++) {
-    float gain = brightness[r];
-    for (int c = 0; c < NUM_COLUMNS; c++) {
-      pixel* p = pixels + pixel_index(r, c);
-      float red = p->r, green = p->g, blue = p->b;
-      float white = 0.3*red + 0.59*green + 0.11*blue;
-      red = white*desat_level + red*(1 - desat_level);
-      green = white*desat_level + green*(1 - desat_level);
-      blue = white*desat_level + blue*(1 - desat_level);
-      float x = gain * (red + (gain > 1 ? gain - 1 : 0));
-      p->r = x > 255 ? 255 : x;
-      x = gain * (green + (gain > 1 ? gain - 1 : 0));
-      p->g = x > 255 ? 255 : x;
-      x = gain * (blue + (gain > 1 ? gain - 1 : 0));
-      p->b = x > 255 ? 255 : x;
-    }
-    gain = spine_brightness[r];
-    pixel* p = spine + r;
-    float x = gain * (p->r + (gain > 1 ? gain - 1 : 0));
-    p->r = x > 255 ? 255 : x;
-    x = gain * (p->g + (gain > 1 ? gain - 1 : 0));
-    p->g = x > 255 ? 255 : x;
-    x = gain * (p->b + (gain > 1 ? gain - 1 : 0));
-    p->b = x > 255 ? 255 : x;
-  }
+  post_process_rows((uint8_t*) pixels, NUM_ROWS, NUM_COLUMNS, brightness,
+                    desat_level, body16[0], body16[1], body16[2]);
+  post_process_rows((uint8_t*) spine, NUM_ROWS, 1, spine_brightness, 0,
+                    spine16[0], spine16[1], spine16[2]);
 
   for (int i = 0; i < HEAD_PIXELS; i++) {
     pixel* p = &head[i];
-    p->r *= dim_level;
-    p->g *= dim_level;
-    p->b *= dim_level;
+    head16[0][i] = p->r*dim_level*256;
+    head16[1][i] = p->g*dim_level*256;
+    head16[2][i] = p->b*dim_level*256;
   }
 
   i = midi_pattern_selected();
@@ -1928,21 +1961,35 @@ void next_frame(int frame) {
       if (d > 0) {
         short alpha = sqrt(d)*256/6;
         for (int c = 0; c < NUM_COLUMNS; c++) {
-          paint_rgb(pixels, pixel_index(r, c), 255, 0, 0, alpha);
+          int i = grid_index(r, c);
+          body16[0][i] = (POST_MAX*alpha + body16[0][i]*(256 - alpha)) >> 8;
+          body16[1][i] = (body16[1][i]*(256 - alpha)) >> 8;
+          body16[2][i] = (body16[2][i]*(256 - alpha)) >> 8;
         }
       }
     }
-    red_thing++;
+    red_thing += dt;
     if (red_thing > NUM_ROWS) {
       red_thing = -10;
     }
   }
 
-  put_head_pixels((byte*) head, HEAD_PIXELS);
-  put_spine_pixels((byte*) spine, NUM_ROWS);
+  // The one conversion back to bytes, with the body going straight into
+  // wiring order.
+  post_process_output(head16[0], head16[1], head16[2], HEAD_PIXELS, 0,
+                      (byte*) head_out);
+  post_process_output(spine16[0], spine16[1], spine16[2], NUM_ROWS, 0,
+                      (byte*) spine_out);
+  put_head_pixels((byte*) head_out, HEAD_PIXELS);
+  put_spine_pixels((byte*) spine_out, NUM_ROWS);
 
+  for (int r = 0; r < NUM_ROWS; r++) {
+    int i = grid_index(r, 0);
+    post_process_output(body16[0] + i, body16[1] + i, body16[2] + i,
+                        NUM_COLUMNS, r % 2, (byte*) (wire_pixels + i));
+  }
   for (int s = 0; s < NUM_SEGS; s++) {
-    put_segment_pixels(s, (byte*) (pixels + s*SEG_PIXELS), SEG_PIXELS);
+    put_segment_pixels(s, (byte*) (wire_pixels + s*SEG_PIXELS), SEG_PIXELS);
   }
 
   if (strcmp(get_button_sequence(), "abxbx") == 0) {
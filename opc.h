@@ -30,6 +30,26 @@ typedef struct { u8 r, g, b; } pixel;
 /* OPC command codes */
 #define OPC_SET_PIXELS 0
 
+/* Compressed forms of OPC_SET_PIXELS, sent by sinks with compression on. */
+/* The payload is a 16-bit pixel count followed by runs, each starting with */
+/* a control byte n: if n < 128, n + 1 literal pixels follow; otherwise one */
+/* pixel follows, repeated n - 126 times.  For OPC_SET_PIXELS_DELTA, the */
+/* decoded pixels are XORed into the pixels last set on the same address by */
+/* a compressed command on the same connection (black if there are none). */
+#define OPC_SET_PIXELS_RLE 0x80
+#define OPC_SET_PIXELS_DELTA 0x81
+
+/* OPC over UDP: each frame (a run of OPC messages) is split into datagrams */
+/* of at most OPC_UDP_MAX_DATAGRAM bytes, which fits an Ethernet MTU.  Each */
+/* datagram starts with an 8-byte header: a 32-bit frame sequence number, a */
+/* 16-bit fragment index, a flags byte and a reserved byte, big-endian. */
+#define OPC_UDP_MAX_DATAGRAM 1472
+#define OPC_UDP_HEADER_SIZE 8
+#define OPC_UDP_END_OF_FRAME 1
+
+/* Default limits on the number of sinks and sources in one process.  Each */
+/* is allocated only when it is created; opc_set_max_sinks and */
+/* opc_set_max_sources change the limits. */
 #define OPC_MAX_SINKS 64
 #define OPC_MAX_SOURCES 64
 
@@ -43,26 +63,101 @@ typedef int opc_sink;
 /* opened as necessary (and reopened if it closes). */
 opc_sink opc_new_sink(char* hostname, u16 port);
 
+/* Creates a new OPC sink that never blocks the caller.  A background thread */
+/* owns the connection: it connects, reconnects and sends.  Each frame passed */
+/* to opc_put_frame (or opc_put_pixels, which is a one-channel frame) replaces */
+/* any earlier frame the thread has not started sending yet, so send whole */
+/* frames with opc_put_frame.  Link with -lpthread. */
+opc_sink opc_new_async_sink(char* hostname, u16 port);
+
+/* Creates a new OPC sink that sends frames as UDP datagrams instead of over */
+/* a TCP connection, so a lost packet costs one frame instead of stalling */
+/* every frame behind it.  The receiver must use opc_new_udp_source. */
+opc_sink opc_new_udp_sink(char* hostname, u16 port);
+
+/* Backpressure policies: what a sink does with a message that its */
+/* connection cannot take right away. */
+#define OPC_BLOCK 0  /* wait until it can be sent, as opc_new_sink does */
+#define OPC_DROP 1  /* drop it */
+#define OPC_QUEUE 2  /* queue it, unless too much is queued already */
+
+/* Creates a new OPC sink whose sends never wait on the network.  Each */
+/* message goes straight from the caller's buffer to the socket; only what */
+/* the kernel will not take yet is copied.  'policy' says what to do with */
+/* the rest (OPC_QUEUE keeps at most queue_limit bytes), and while there is */
+/* no connection, messages are dropped.  Call opc_flush regularly. */
+opc_sink opc_new_nonblocking_sink(char* hostname, u16 port,
+                                  int policy, u32 queue_limit);
+
+/* Sends what a non-blocking sink has queued, as far as it can without */
+/* waiting, and continues connecting if necessary. */
+void opc_flush(opc_sink sink);
+
+/* Sets the maximum number of sinks that may be created. */
+void opc_set_max_sinks(int max_sinks);
+
 /* Ensures that the connection for a sink is open, retrying until success. */
+/* Does nothing for an async sink. */
 void opc_connect(opc_sink sink);
 
 /* Sends RGB data for 'count' pixels to address 'address'. */
 void opc_put_pixels(opc_sink sink, u8 address, u16 count, pixel* pixels);
 
+/* Sends a whole multi-channel frame: counts[i] pixels from pixels[i] to */
+/* addresses[i], for each of the num_channels channels.  The frame is */
+/* gathered into a single sendmsg() instead of one send() per buffer. */
+void opc_put_frame(opc_sink sink, int num_channels,
+                   u8* addresses, u16* counts, pixel** pixels);
+
+/* Sets TCP_CORK on the sink's connection (where supported).  While corked, */
+/* partial packets are held back; uncorking flushes them.  Use this to */
+/* coalesce several opc_put_pixels calls into full-sized packets.  An async */
+/* sink's sender thread makes the change, before it sends anything else. */
+void opc_set_cork(opc_sink sink, int corked);
+
+/* Turns compression on or off for a sink.  While on, each channel is sent */
+/* as OPC_SET_PIXELS_RLE, OPC_SET_PIXELS_DELTA or plain OPC_SET_PIXELS, */
+/* whichever is smallest; this pays off for flat colours, fades and mostly */
+/* static frames, and costs nothing for noise.  UDP sinks never send deltas. */
+/* The receiver must be an opc_server from this tree. */
+void opc_set_compression(opc_sink sink, int enabled);
+
+/* Frame counters for an async or non-blocking sink.  A non-blocking sink */
+/* counts each message (or frame, with compression on) as one frame. */
+typedef struct {
+  u32 frames_sent;  /* frames written to the socket (or queued) */
+  u32 frames_dropped;  /* frames overwritten before sending, or lost on error */
+} opc_sink_stats;
+
+/* Reads the frame counters for an async or non-blocking sink. */
+void opc_get_sink_stats(opc_sink sink, opc_sink_stats* stats);
+
 // OPC server functions ----------------------------------------------------
 
 /* Handle for an OPC source created by opc_new_source. */
 typedef int opc_source;
 
-/* Handler called by opc_receive when pixel data is received. */
+/* Handler called by opc_receive when pixel data is received.  'pixels' points */
+/* into the source's receive buffer and is only valid until the handler returns. */
 typedef void opc_handler(u8 address, u16 count, pixel* pixels);
 
-/* Creates a new OPC source by listening on the specified TCP port.  At most */
-/* one incoming connection is accepted at a time; if the connection closes, */
-/* we will begin listening for another connection. */
+/* Creates a new OPC source by listening on the specified TCP port.  Any */
+/* number of clients may be connected at once; each connection is parsed */
+/* independently, and the port stays open while clients come and go. */
 opc_source opc_new_source(u16 port);
 
-/* Handles incoming connections and pixel data on a given OPC source. */
+/* Creates a new OPC source that receives frames from an opc_new_udp_sink on */
+/* the specified UDP port.  Only complete frames are passed to the handler; */
+/* a frame with a missing fragment, or older than one already handled, is */
+/* dropped. */
+opc_source opc_new_udp_source(u16 port);
+
+/* Sets the maximum number of sources that may be created. */
+void opc_set_max_sources(int max_sources);
+
+/* Handles incoming connections and pixel data on a given OPC source, waiting */
+/* at most timeout_ms for something to arrive.  Uses epoll, so the cost of a */
+/* call does not grow with the number of idle clients. */
 void opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms);
 
 #endif  /* OPC_H */
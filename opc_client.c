@@ -1,56 +1,222 @@
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "opc.h"
 
 /* If connection fails, try again in 0.1 seconds. */
 #define OPC_RECONNECT_DELAY_US 100000
 
+/* Maximum number of channels sent with one sendmsg() by opc_put_frame. */
+#define OPC_MAX_FRAME_CHANNELS 256
+
+/* In the shared mailbox slot of an async sink, this bit marks a frame that */
+/* the sender thread has not picked up yet. */
+#define OPC_FRESH 4
+
+/* Largest RLE payload for one message: the pixel count, plus one control */
+/* byte per 128 literal pixels. */
+#define OPC_MAX_RLE_LENGTH (2 + (0xffff / 3)*3 + (0xffff / 3 + 127) / 128)
+
+/* A serialized frame (OPC headers and payloads, back to back). */
+typedef struct {
+  u8* data;
+  u32 length;
+  u32 capacity;
+} opc_frame_buffer;
+
 /* Internal structure for a sink.  sock >= 0 iff the connection is open. */
+/* For an async sink, the socket and 'corked' belong to the sender thread, */
+/* which applies the caller's 'cork_request' before it sends.  The three */
+/* frame buffers rotate between the caller ('back'), the mailbox ('middle', */
+/* swapped atomically) and the sender thread ('front').  A UDP sink uses */
+/* frames[0] to serialize frames before splitting them into datagrams. */
+/* With compression on, each frame is compressed into 'packed' just before */
+/* sending, and previous[a] holds the last pixels sent to address a in a */
+/* compressed message on the current connection (previous_count[a] is 0 if */
+/* there are none).  A sink with a policy other than OPC_BLOCK never waits */
+/* on its socket: 'pending' holds whatever the kernel would not take yet, */
+/* and 'connecting' is set while a non-blocking connect() is in progress. */
 typedef struct {
   struct sockaddr_in address;
   int sock;
+  int corked;
+  int cork_request;
+  int udp;
+  u32 sequence;
+  int compress;
+  opc_frame_buffer packed;
+  u8* delta;
+  pixel* previous[256];
+  u16 previous_count[256];
+  int async;
+  pthread_t thread;
+  sem_t wakeup;
+  opc_frame_buffer frames[3];
+  int back;
+  int middle;
+  int front;
+  u32 frames_sent;
+  u32 frames_dropped;
+  int policy;
+  u32 queue_limit;
+  int connecting;
+  double next_attempt;
+  opc_frame_buffer pending;
 } opc_sink_info;
 
-static opc_sink_info opc_sinks[OPC_MAX_SINKS];
+/* Sinks are allocated as they are created; opc_sinks grows to match.  An */
+/* async sink's thread holds on to its opc_sink_info, never the array. */
+static opc_sink_info** opc_sinks = NULL;
+static int opc_sinks_capacity = 0;
 static opc_sink opc_next_sink = 0;
+static int opc_max_sinks = OPC_MAX_SINKS;
+
+void opc_set_max_sinks(int max_sinks) {
+  opc_max_sinks = max_sinks;
+}
+
+static opc_sink_info* opc_get_sink(opc_sink sink) {
+  if (sink < 0 || sink >= opc_next_sink) {
+    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+    return NULL;
+  }
+  return opc_sinks[sink];
+}
 
 /* TODO(kpy): Add support for named hosts. */
 opc_sink opc_new_sink(char* hostname, u16 port) {
   opc_sink_info* info;
+  opc_sink_info** sinks;
+  int capacity;
 
   /* Allocate an opc_sink_info entry. */
-  if (opc_next_sink >= OPC_MAX_SINKS) {
+  if (opc_next_sink >= opc_max_sinks) {
     fprintf(stderr, "OPC: No more sinks available\n");
     return -1;
   }
-  info = &opc_sinks[opc_next_sink];
+  if (opc_next_sink >= opc_sinks_capacity) {
+    capacity = opc_sinks_capacity ? opc_sinks_capacity*2 : 4;
+    sinks = realloc(opc_sinks, capacity*sizeof(opc_sink_info*));
+    if (!sinks) {
+      fprintf(stderr, "OPC: Out of memory for new sink\n");
+      return -1;
+    }
+    opc_sinks = sinks;
+    opc_sinks_capacity = capacity;
+  }
+  /* All counters, flags and buffer pointers start out zero. */
+  info = calloc(1, sizeof(opc_sink_info));
+  if (!info) {
+    fprintf(stderr, "OPC: Out of memory for new sink\n");
+    return -1;
+  }
 
   info->sock = -1;
   info->address.sin_family = AF_INET;
   info->address.sin_port = htons(port);
   if (inet_pton(AF_INET, hostname, &(info->address.sin_addr)) != 1) {
     fprintf(stderr, "OPC: Invalid IP address: %s\n", hostname);
+    free(info);
     return -1;
   }
 
   /* Increment opc_next_sink only if we were successful. */
+  opc_sinks[opc_next_sink] = info;
   return opc_next_sink++;
 }
 
-void opc_connect(opc_sink sink) {
+/* Starts or finishes a non-blocking connect(), returning at once.  Failed */
+/* attempts are retried no more often than OPC_RECONNECT_DELAY_US. */
+static void opc_try_open(opc_sink_info* info) {
+  struct pollfd poller;
+  struct timeval now;
+  socklen_t error_len = sizeof(int);
+  char buffer[64];
+  int error = 0;
+  int one = 1;
+
+  if (info->sock < 0) {
+    gettimeofday(&now, NULL);
+    if (now.tv_sec + 1e-6*now.tv_usec < info->next_attempt) {
+      return;
+    }
+    info->next_attempt = now.tv_sec + 1e-6*(now.tv_usec +
+                                             OPC_RECONNECT_DELAY_US);
+    info->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+    setsockopt(info->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    fcntl(info->sock, F_SETFL, fcntl(info->sock, F_GETFL, 0) | O_NONBLOCK);
+    if (connect(info->sock, (struct sockaddr*) &(info->address),
+                sizeof(info->address)) != 0) {
+      if (errno == EINPROGRESS) {
+        info->connecting = 1;
+        return;
+      }
+      error = errno;
+    }
+  } else if (info->connecting) {
+    poller.fd = info->sock;
+    poller.events = POLLOUT;
+    if (poll(&poller, 1, 0) <= 0) {
+      return;  /* still connecting */
+    }
+    getsockopt(info->sock, SOL_SOCKET, SO_ERROR, &error, &error_len);
+  } else {
+    return;  /* already connected */
+  }
+
+  info->connecting = 0;
+  inet_ntop(AF_INET, &(info->address.sin_addr), buffer, 64);
+  if (error) {
+    fprintf(stderr, "OPC: Failed to connect to %s port %d: %s\n",
+            buffer, ntohs(info->address.sin_port), strerror(error));
+    close(info->sock);
+    info->sock = -1;
+    return;
+  }
+  fprintf(stderr, "OPC: Connected to %s port %d\n",
+          buffer, ntohs(info->address.sin_port));
+  info->pending.length = 0;
+  memset(info->previous_count, 0, sizeof(info->previous_count));
+}
+
+/* Opens the connection for a sink if necessary, retrying until success. */
+/* For a non-blocking sink, only tries once (see opc_try_open). */
+static void opc_open(opc_sink_info* info) {
   int sock;
   struct timeval timeout;
-  opc_sink_info* info = &opc_sinks[sink];
   char buffer[64];
+  int one = 1;
 
-  if (sink < 0 || sink >= opc_next_sink) {
-    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+  if (info->policy != OPC_BLOCK) {
+    opc_try_open(info);
     return;
   }
+
+  if (info->sock < 0 && info->udp) {
+    /* Connecting a UDP socket just fixes the destination address. */
+    sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (connect(sock, (struct sockaddr*) &(info->address),
+                sizeof(info->address)) != 0) {
+      perror("OPC: Could not set UDP destination");
+      close(sock);
+      return;
+    }
+    info->sock = sock;
+  }
   if (info->sock < 0) {  /* not connected */
     while (1) {
       /* Create the socket. */
@@ -61,6 +227,13 @@ void opc_connect(opc_sink sink) {
       timeout.tv_usec = 0;
       setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
+      /* Frames are sent whole, so there is nothing to gain from Nagle. */
+      setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef TCP_CORK
+      setsockopt(sock, IPPROTO_TCP, TCP_CORK,
+                 &info->corked, sizeof(info->corked));
+#endif
+
       /* Connect the socket. */
       if (connect(sock, (struct sockaddr*) &(info->address),
                   sizeof(info->address)) == 0) {
@@ -68,6 +241,8 @@ void opc_connect(opc_sink sink) {
         fprintf(stderr, "OPC: Connected to %s port %d\n",
                 buffer, ntohs(info->address.sin_port));
         info->sock = sock;
+        /* The receiver starts from scratch, so deltas must too. */
+        memset(info->previous_count, 0, sizeof(info->previous_count));
         return;
       }
 
@@ -82,47 +257,178 @@ void opc_connect(opc_sink sink) {
   }
 }
 
-static void opc_close(opc_sink sink) {
-  opc_sink_info* info = &opc_sinks[sink];
+void opc_connect(opc_sink sink) {
+  opc_sink_info* info = opc_get_sink(sink);
 
-  if (sink < 0 || sink >= opc_next_sink) {
-    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
-    return;
+  if (info && !info->async) {  /* an async sink's thread does its own connecting */
+    opc_open(info);
   }
+}
+
+static void opc_close(opc_sink_info* info) {
   if (info->sock >= 0) {
     close(info->sock);
     info->sock = -1;
   }
+  info->connecting = 0;
+}
+
+/* Appends bytes to a buffer, growing it if necessary.  Returns 0 if memory */
+/* could not be allocated. */
+static int opc_append(opc_frame_buffer* buffer, u8* data, u32 length) {
+  u32 capacity = buffer->capacity ? buffer->capacity : 4096;
+  u8* grown;
+
+  while (capacity < buffer->length + length) {
+    capacity *= 2;
+  }
+  if (capacity > buffer->capacity) {
+    grown = realloc(buffer->data, capacity);
+    if (!grown) {
+      fprintf(stderr, "OPC: Out of memory for a %d-byte queue\n", capacity);
+      return 0;
+    }
+    buffer->data = grown;
+    buffer->capacity = capacity;
+  }
+  memcpy(buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  return 1;
+}
+
+/* Counts a message that a non-blocking sink could not send.  Any delta */
+/* after it would refer to pixels the receiver never saw, so start over. */
+static void opc_drop(opc_sink_info* info) {
+  info->frames_dropped++;
+  memset(info->previous_count, 0, sizeof(info->previous_count));
 }
 
-static void opc_send(opc_sink sink, const u8* buffer, ssize_t length) {
-  ssize_t total_sent = 0;
+/* Writes as much of a non-blocking sink's pending data as the socket will */
+/* take without waiting.  Returns 0 if the connection was lost. */
+static int opc_flush_pending(opc_sink_info* info) {
   ssize_t sent;
-  opc_sink_info* info = &opc_sinks[sink];
 
-  if (sink < 0 || sink >= opc_next_sink) {
-    fprintf(stderr, "OPC: Sink %d does not exist\n", sink);
+  if (info->pending.length == 0) {
+    return 1;
+  }
+  sent = send(info->sock, info->pending.data, info->pending.length,
+              MSG_NOSIGNAL | MSG_DONTWAIT);
+  if (sent < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return 1;
+    }
+    perror("OPC: Error sending data");
+    opc_close(info);
+    return 0;
+  }
+  info->pending.length -= sent;
+  memmove(info->pending.data, info->pending.data + sent, info->pending.length);
+  return 1;
+}
+
+/* Sends a message on a non-blocking sink, straight from the caller's */
+/* buffers.  Whatever the socket will not take now is dropped or queued */
+/* according to the sink's policy, except that the rest of a partly sent */
+/* message is always kept so that the stream stays well-formed. */
+static void opc_sendv_nonblocking(opc_sink_info* info,
+                                  struct iovec* iov, int iovcnt) {
+  struct msghdr message;
+  ssize_t sent = 0;
+  u32 length = 0;
+  int i;
+
+  for (i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  opc_try_open(info);
+  if (info->sock < 0 || info->connecting || !opc_flush_pending(info)) {
+    opc_drop(info);
+    return;
+  }
+  if (info->pending.length == 0) {
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    sent = sendmsg(info->sock, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (sent < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("OPC: Error sending data");
+        opc_close(info);
+        opc_drop(info);
+        return;
+      }
+      sent = 0;
+    }
+    if (sent == length) {
+      info->frames_sent++;
+      return;
+    }
+  }
+  if (sent == 0 && (info->policy == OPC_DROP ||
+                    info->pending.length + length > info->queue_limit)) {
+    opc_drop(info);
+    return;
+  }
+
+  /* Keep the unsent part, to go out ahead of the next message. */
+  for (i = 0; i < iovcnt; i++) {
+    if (sent >= iov[i].iov_len) {
+      sent -= iov[i].iov_len;
+      continue;
+    }
+    if (!opc_append(&info->pending, (u8*) iov[i].iov_base + sent,
+                    iov[i].iov_len - sent)) {
+      opc_close(info);  /* the stream is broken mid-message */
+      opc_drop(info);
+      return;
+    }
+    sent = 0;
+  }
+  info->frames_sent++;
+}
+
+/* Sends iovcnt buffers with as few system calls as possible.  The iovec */
+/* array is modified as data is sent. */
+static void opc_sendv(opc_sink_info* info, struct iovec* iov, int iovcnt) {
+  struct msghdr message;
+  ssize_t sent;
+
+  if (info->policy != OPC_BLOCK) {
+    opc_sendv_nonblocking(info, iov, iovcnt);
     return;
   }
-  opc_connect(sink);
-  while (total_sent < length) {
-    sent = send(info->sock, buffer + total_sent, length - total_sent, 0);
+  opc_open(info);
+  memset(&message, 0, sizeof(message));
+  while (iovcnt > 0) {
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    sent = sendmsg(info->sock, &message, MSG_NOSIGNAL);
     if (sent < 0) {
       perror("OPC: Error sending data");
-      opc_close(sink);
+      opc_close(info);
       break;
     }
-    total_sent += sent;
+    /* Skip over whatever was sent, which may end partway into a buffer. */
+    while (iovcnt > 0 && sent >= iov->iov_len) {
+      sent -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (u8*) iov->iov_base + sent;
+      iov->iov_len -= sent;
+    }
   }
 }
 
-void opc_put_pixels(opc_sink sink, u8 address, u16 count, pixel* pixels) {
-  u8 header[4];
-  ssize_t length;
+/* Fills in a 4-byte OPC header and returns the payload length. */
+static u16 opc_set_header(u8* header, u8 address, u16 count) {
+  u16 length;
 
   if (count > 0xffff / 3) {
     fprintf(stderr, "OPC: Maximum pixel count exceeded (%d > %d)\n",
             count, 0xffff / 3);
+    count = 0xffff / 3;
   }
   length = count * 3;
 
@@ -130,6 +436,439 @@ void opc_put_pixels(opc_sink sink, u8 address, u16 count, pixel* pixels) {
   header[1] = OPC_SET_PIXELS;
   header[2] = length >> 8;
   header[3] = length & 0xff;
-  opc_send(sink, header, 4);
-  opc_send(sink, (u8*) pixels, length);
+  return length;
+}
+
+/* Serializes a frame into a buffer, growing it if necessary.  Returns 0 if */
+/* memory could not be allocated. */
+static int opc_serialize_frame(opc_frame_buffer* frame, int num_channels,
+                               u8* addresses, u16* counts, pixel** pixels) {
+  u32 length = 0;
+  u16 payload_length;
+  u8* d;
+  int c;
+
+  for (c = 0; c < num_channels; c++) {
+    length += 4 + (counts[c] > 0xffff / 3 ? 0xffff / 3 : counts[c])*3;
+  }
+  if (length > frame->capacity) {
+    d = realloc(frame->data, length);
+    if (!d) {
+      fprintf(stderr, "OPC: Out of memory for a %d-byte frame\n", length);
+      return 0;
+    }
+    frame->data = d;
+    frame->capacity = length;
+  }
+  for (c = 0, d = frame->data; c < num_channels; c++) {
+    payload_length = opc_set_header(d, addresses[c], counts[c]);
+    memcpy(d + 4, pixels[c], payload_length);
+    d += 4 + payload_length;
+  }
+  frame->length = length;
+  return 1;
+}
+
+/* Encodes 'count' pixels in the PackBits-like form used by the compressed */
+/* commands and returns the number of bytes written to 'out'. */
+static u32 opc_rle_encode(u8* out, u8* data, u16 count) {
+  u8* d = out;
+  int i = 0, j, run;
+
+  *d++ = count >> 8;
+  *d++ = count;
+  while (i < count) {
+    for (run = 1; i + run < count && run < 129; run++) {
+      if (memcmp(data + i*3, data + (i + run)*3, 3) != 0) {
+        break;
+      }
+    }
+    if (run >= 2) {
+      *d++ = 126 + run;
+      memcpy(d, data + i*3, 3);
+      d += 3;
+      i += run;
+      continue;
+    }
+    /* Collect literals up to the start of the next run. */
+    for (j = i + 1; j < count && j - i < 128; j++) {
+      if (j + 1 < count && memcmp(data + j*3, data + (j + 1)*3, 3) == 0) {
+        break;
+      }
+    }
+    *d++ = j - i - 1;
+    memcpy(d, data + i*3, (j - i)*3);
+    d += (j - i)*3;
+    i = j;
+  }
+  return d - out;
+}
+
+/* Writes one message for the given pixels at 'out', choosing whichever of */
+/* the RLE, delta and plain forms is smallest, and returns the number of */
+/* bytes written.  previous[address] follows the receiver's delta reference, */
+/* which only compressed messages update, so a plain message leaves it be. */
+static u32 opc_compress_message(opc_sink_info* info, u8* out,
+                                u8 address, u16 count, u8* data) {
+  u8* previous = (u8*) info->previous[address];
+  u32 length, delta_length, raw_length = count*3;
+  pixel* p;
+  int i, delta = 0;
+
+  length = opc_rle_encode(out + 4, data, count);
+  out[1] = OPC_SET_PIXELS_RLE;
+
+  /* A lost datagram would corrupt every delta after it, so UDP gets none. */
+  if (!info->udp && info->previous_count[address] == count && count > 0) {
+    for (i = 0; i < count*3; i++) {
+      previous[i] ^= data[i];
+    }
+    delta = 1;
+    delta_length = opc_rle_encode(info->delta, previous, count);
+    if (delta_length < length) {
+      memcpy(out + 4, info->delta, delta_length);
+      out[1] = OPC_SET_PIXELS_DELTA;
+      length = delta_length;
+    }
+  }
+  out[0] = address;
+
+  /* Noisy pixels can take more room compressed than raw, and past 0xffff */
+  /* bytes the length would not fit in the header at all. */
+  if (length >= raw_length || length > 0xffff) {
+    if (delta) {
+      for (i = 0; i < count*3; i++) {
+        previous[i] ^= data[i];
+      }
+    }
+    out[1] = OPC_SET_PIXELS;
+    out[2] = raw_length >> 8;
+    out[3] = raw_length;
+    memcpy(out + 4, data, raw_length);
+    return 4 + raw_length;
+  }
+  out[2] = length >> 8;
+  out[3] = length;
+
+  if (info->previous_count[address] != count) {
+    p = realloc(info->previous[address], count*3 + 1);
+    if (!p) {
+      info->previous_count[address] = 0;
+      return 4 + length;
+    }
+    info->previous[address] = p;
+  }
+  memcpy(info->previous[address], data, count*3);
+  info->previous_count[address] = count;
+  return 4 + length;
+}
+
+/* Compresses a serialized frame into info->packed.  Returns 0 if memory */
+/* could not be allocated. */
+static int opc_compress_frame(opc_sink_info* info, opc_frame_buffer* frame) {
+  u32 capacity = 0;
+  u16 payload_length;
+  u8* data;
+  u8* d;
+
+  /* RLE adds at most a 2-byte count and a control byte per 128 pixels. */
+  for (data = frame->data; data < frame->data + frame->length;
+       data += 4 + payload_length) {
+    payload_length = (data[2] << 8) | data[3];
+    capacity += 4 + 2 + payload_length + (payload_length / 3 + 127) / 128;
+  }
+  if (capacity > info->packed.capacity) {
+    d = realloc(info->packed.data, capacity);
+    if (!d) {
+      fprintf(stderr, "OPC: Out of memory for a %d-byte frame\n", capacity);
+      return 0;
+    }
+    info->packed.data = d;
+    info->packed.capacity = capacity;
+  }
+  if (!info->delta && !(info->delta = malloc(OPC_MAX_RLE_LENGTH))) {
+    fprintf(stderr, "OPC: Out of memory for delta buffer\n");
+    return 0;
+  }
+  d = info->packed.data;
+  for (data = frame->data; data < frame->data + frame->length;
+       data += 4 + payload_length) {
+    payload_length = (data[2] << 8) | data[3];
+    d += opc_compress_message(info, d, data[0], payload_length / 3, data + 4);
+  }
+  info->packed.length = d - info->packed.data;
+  return 1;
+}
+
+/* Sends a serialized frame over UDP as a numbered series of datagrams, the */
+/* last of which carries the end-of-frame flag. */
+static void opc_send_datagrams(opc_sink_info* info, u8* data, u32 length) {
+  u8 header[OPC_UDP_HEADER_SIZE];
+  struct iovec iov[2];
+  struct msghdr message;
+  u32 offset = 0, chunk;
+  u16 fragment = 0;
+
+  opc_open(info);
+  if (info->sock < 0) {
+    return;
+  }
+  info->sequence++;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = 2;
+  do {
+    chunk = length - offset;
+    if (chunk > OPC_UDP_MAX_DATAGRAM - OPC_UDP_HEADER_SIZE) {
+      chunk = OPC_UDP_MAX_DATAGRAM - OPC_UDP_HEADER_SIZE;
+    }
+    header[0] = info->sequence >> 24;
+    header[1] = info->sequence >> 16;
+    header[2] = info->sequence >> 8;
+    header[3] = info->sequence;
+    header[4] = fragment >> 8;
+    header[5] = fragment;
+    header[6] = (offset + chunk == length) ? OPC_UDP_END_OF_FRAME : 0;
+    header[7] = 0;
+    iov[0].iov_base = header;
+    iov[0].iov_len = OPC_UDP_HEADER_SIZE;
+    iov[1].iov_base = data + offset;
+    iov[1].iov_len = chunk;
+    /* A refused datagram just means nobody is listening yet; the frame is */
+    /* lost, which is what UDP mode is for. */
+    if (sendmsg(info->sock, &message, MSG_NOSIGNAL) < 0) {
+      if (errno != ECONNREFUSED) {
+        perror("OPC: Error sending datagram");
+      }
+      return;
+    }
+    offset += chunk;
+    fragment++;
+  } while (offset < length);
+}
+
+/* Sends a serialized frame, compressing it first if compression is on. */
+static void opc_send_frame(opc_sink_info* info, opc_frame_buffer* frame) {
+  struct iovec iov;
+
+  if (info->compress) {
+    /* Connect first: a new connection resets the delta state. */
+    opc_open(info);
+    if (!opc_compress_frame(info, frame)) {
+      return;
+    }
+    frame = &info->packed;
+  }
+  if (info->udp) {
+    opc_send_datagrams(info, frame->data, frame->length);
+  } else {
+    iov.iov_base = frame->data;
+    iov.iov_len = frame->length;
+    opc_sendv(info, &iov, 1);
+  }
+}
+
+/* Sender thread for an async sink: waits for a fresh frame in the mailbox, */
+/* takes it, and sends it, (re)connecting as often as necessary.  A change */
+/* to the cork requested by opc_set_cork is applied first. */
+static void* opc_sender(void* arg) {
+  opc_sink_info* info = arg;
+  int slot, corked;
+
+  while (1) {
+    sem_wait(&info->wakeup);
+    corked = __sync_fetch_and_add(&info->cork_request, 0);
+    if (corked != info->corked) {
+      info->corked = corked;
+#ifdef TCP_CORK
+      if (info->sock >= 0) {
+        setsockopt(info->sock, IPPROTO_TCP, TCP_CORK,
+                   &info->corked, sizeof(info->corked));
+      }
+#endif
+    }
+    if (!(info->middle & OPC_FRESH)) {
+      continue;
+    }
+    __sync_synchronize();  /* finished with the old front buffer */
+    slot = __sync_lock_test_and_set(&info->middle, info->front);
+    info->front = slot & ~OPC_FRESH;
+    opc_send_frame(info, &info->frames[info->front]);
+    if (info->sock >= 0) {
+      __sync_fetch_and_add(&info->frames_sent, 1);
+    } else {
+      __sync_fetch_and_add(&info->frames_dropped, 1);
+    }
+  }
+  return NULL;
+}
+
+/* Serializes a frame into the caller's buffer and swaps it into the mailbox. */
+/* Any frame still waiting there is discarded: the newest frame always wins. */
+static void opc_post_frame(opc_sink_info* info, int num_channels,
+                           u8* addresses, u16* counts, pixel** pixels) {
+  int slot;
+
+  if (!opc_serialize_frame(&info->frames[info->back],
+                           num_channels, addresses, counts, pixels)) {
+    return;
+  }
+  __sync_synchronize();  /* frame contents must be visible before the swap */
+  slot = __sync_lock_test_and_set(&info->middle, info->back | OPC_FRESH);
+  info->back = slot & ~OPC_FRESH;
+  if (slot & OPC_FRESH) {
+    __sync_fetch_and_add(&info->frames_dropped, 1);
+  } else {
+    sem_post(&info->wakeup);
+  }
+}
+
+opc_sink opc_new_async_sink(char* hostname, u16 port) {
+  opc_sink sink = opc_new_sink(hostname, port);
+  opc_sink_info* info;
+
+  if (sink < 0) {
+    return -1;
+  }
+  info = opc_sinks[sink];
+  info->back = 0;
+  info->middle = 1;
+  info->front = 2;
+  info->frames_sent = 0;
+  info->frames_dropped = 0;
+  info->async = 1;
+  sem_init(&info->wakeup, 0, 0);
+  if (pthread_create(&info->thread, NULL, opc_sender, info) != 0) {
+    perror("OPC: Could not start sender thread");
+    info->async = 0;
+  }
+  return sink;
+}
+
+opc_sink opc_new_udp_sink(char* hostname, u16 port) {
+  opc_sink sink = opc_new_sink(hostname, port);
+
+  if (sink >= 0) {
+    opc_sinks[sink]->udp = 1;
+  }
+  return sink;
+}
+
+opc_sink opc_new_nonblocking_sink(char* hostname, u16 port,
+                                  int policy, u32 queue_limit) {
+  opc_sink sink = opc_new_sink(hostname, port);
+
+  if (sink >= 0) {
+    opc_sinks[sink]->policy = policy;
+    opc_sinks[sink]->queue_limit = queue_limit;
+  }
+  return sink;
+}
+
+void opc_flush(opc_sink sink) {
+  opc_sink_info* info = opc_get_sink(sink);
+
+  if (info && info->policy != OPC_BLOCK) {
+    opc_try_open(info);
+    if (info->sock >= 0 && !info->connecting) {
+      opc_flush_pending(info);
+    }
+  }
+}
+
+void opc_get_sink_stats(opc_sink sink, opc_sink_stats* stats) {
+  opc_sink_info* info = opc_get_sink(sink);
+
+  if (!info) {
+    return;
+  }
+  stats->frames_sent = __sync_fetch_and_add(&info->frames_sent, 0);
+  stats->frames_dropped = __sync_fetch_and_add(&info->frames_dropped, 0);
+}
+
+void opc_put_pixels(opc_sink sink, u8 address, u16 count, pixel* pixels) {
+  opc_sink_info* info = opc_get_sink(sink);
+  u8 header[4];
+  struct iovec iov[2];
+
+  if (!info) {
+    return;
+  }
+  if (info->async || info->udp || info->compress) {
+    opc_put_frame(sink, 1, &address, &count, &pixels);
+    return;
+  }
+
+  iov[0].iov_base = header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = pixels;
+  iov[1].iov_len = opc_set_header(header, address, count);
+  opc_sendv(info, iov, 2);
+}
+
+void opc_put_frame(opc_sink sink, int num_channels,
+                   u8* addresses, u16* counts, pixel** pixels) {
+  opc_sink_info* info = opc_get_sink(sink);
+  u8 headers[OPC_MAX_FRAME_CHANNELS][4];
+  struct iovec iov[OPC_MAX_FRAME_CHANNELS*2];
+  int c, n;
+
+  if (!info) {
+    return;
+  }
+  if (info->async) {
+    opc_post_frame(info, num_channels, addresses, counts, pixels);
+    return;
+  }
+  if (info->udp || info->compress) {
+    if (opc_serialize_frame(&info->frames[0],
+                            num_channels, addresses, counts, pixels)) {
+      opc_send_frame(info, &info->frames[0]);
+    }
+    return;
+  }
+  while (num_channels > 0) {
+    n = num_channels < OPC_MAX_FRAME_CHANNELS ?
+        num_channels : OPC_MAX_FRAME_CHANNELS;
+    for (c = 0; c < n; c++) {
+      iov[c*2].iov_base = headers[c];
+      iov[c*2].iov_len = 4;
+      iov[c*2 + 1].iov_base = pixels[c];
+      iov[c*2 + 1].iov_len = opc_set_header(headers[c], addresses[c], counts[c]);
+    }
+    opc_sendv(info, iov, n*2);
+    addresses += n;
+    counts += n;
+    pixels += n;
+    num_channels -= n;
+  }
+}
+
+void opc_set_cork(opc_sink sink, int corked) {
+  opc_sink_info* info = opc_get_sink(sink);
+
+  if (!info) {
+    return;
+  }
+  if (info->async) {
+    /* The sender thread owns the socket; wake it to apply the change. */
+    __sync_lock_test_and_set(&info->cork_request, corked ? 1 : 0);
+    sem_post(&info->wakeup);
+    return;
+  }
+  info->corked = corked ? 1 : 0;
+#ifdef TCP_CORK
+  if (info->sock >= 0) {
+    setsockopt(info->sock, IPPROTO_TCP, TCP_CORK,
+               &info->corked, sizeof(info->corked));
+  }
+#endif
+}
+
+void opc_set_compression(opc_sink sink, int enabled) {
+  opc_sink_info* info = opc_get_sink(sink);
+
+  if (info) {
+    info->compress = enabled ? 1 : 0;
+  }
 }
@@ -0,0 +1,185 @@
+// Checks OPC compression end to end and reports how much it saves.
+//
+//   gcc -std=c99 -O3 opc_compress_bench.c opc_client.c opc_server.c -lpthread -o bin/opc_compress_bench
+//   bin/opc_compress_bench 100
+//
+// A compressed sink sends to this program, which counts the bytes on the
+// wire and passes them on to an opc_server source; the handler checks that
+// every channel arrives exactly as it was sent.  Exits with status 1 if any
+// pixel differs, or if a frame takes more room compressed than raw.
+
+#define _DEFAULT_SOURCE 1
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "opc.h"
+
+#define SINK_PORT 60671
+#define SOURCE_PORT 60672
+#define MAX_CHANNELS 4
+#define MAX_PIXELS (0xffff / 3)
+
+static pixel sent[MAX_CHANNELS][MAX_PIXELS];
+static int channels_received, mismatches;
+
+void check(u8 address, u16 count, pixel* pixels) {
+  if (address >= MAX_CHANNELS ||
+      memcmp(pixels, sent[address], count*sizeof(pixel))) {
+    mismatches++;
+  }
+  channels_received++;
+}
+
+int listen_on(u16 port) {
+  struct sockaddr_in address;
+  int one = 1, sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) < 0 ||
+      listen(sock, 1) < 0) {
+    perror("listen");
+    exit(2);
+  }
+  return sock;
+}
+
+int connect_to(u16 port) {
+  struct sockaddr_in address;
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons(port);
+  if (connect(sock, (struct sockaddr*) &address, sizeof(address)) < 0) {
+    perror("connect");
+    exit(2);
+  }
+  return sock;
+}
+
+// Passes everything the sink has sent on to the source until the handler
+// has seen all the channels, and returns the number of bytes passed on.
+long relay_frame(int from, int to, opc_source source, int num_channels) {
+  static u8 buffer[1 << 16];
+  long total = 0;
+  ssize_t n;
+  int idle = 0;
+
+  channels_received = 0;
+  while (channels_received < num_channels && idle < 1000) {
+    n = recv(from, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (n > 0) {
+      total += n;
+      if (write(to, buffer, n) != n) {
+        perror("write");
+        exit(2);
+      }
+    }
+    idle = n > 0 ? 0 : idle + 1;
+    opc_receive(source, check, 1);
+  }
+  if (channels_received < num_channels) {
+    fprintf(stderr, "gave up after %d of %d channels\n",
+            channels_received, num_channels);
+    mismatches++;
+  }
+  return total;
+}
+
+// Fills a channel with one of the test patterns for frame f.
+void fill(int kind, int f, pixel* p, int count) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    switch (kind) {
+      case 0:  // flat colour, fading
+        p[i].r = p[i].g = f;
+        p[i].b = 255 - f;
+        break;
+      case 1:  // moving gradient
+        p[i].r = i + f;
+        p[i].g = i*2;
+        p[i].b = 0;
+        break;
+      case 2:  // static, with a few pixels changing
+        if (f == 0 || i % 97 == f % 97) {
+          p[i].r = random();
+          p[i].g = random();
+          p[i].b = random();
+        }
+        break;
+      default:  // noise
+        p[i].r = random();
+        p[i].g = random();
+        p[i].b = random();
+    }
+  }
+}
+
+int run(const char* name, opc_sink sink, int from, int to, opc_source source,
+        int frames, int num_channels, int* kinds, u16* counts) {
+  u8 addresses[MAX_CHANNELS];
+  pixel* pixels[MAX_CHANNELS];
+  long raw = 0, wire = 0, bytes;
+  int f, c, bigger = 0;
+
+  for (c = 0; c < num_channels; c++) {
+    addresses[c] = c;
+    pixels[c] = sent[c];
+  }
+  mismatches = 0;
+  for (f = 0; f < frames; f++) {
+    for (c = 0; c < num_channels; c++) {
+      fill(kinds[c], f, sent[c], counts[c]);
+      raw += 4 + counts[c]*3;
+    }
+    opc_put_frame(sink, num_channels, addresses, counts, pixels);
+    bytes = relay_frame(from, to, source, num_channels);
+    wire += bytes;
+    for (c = 0; c < num_channels; c++) {
+      bytes -= 4 + counts[c]*3;
+    }
+    bigger += bytes > 0;
+  }
+  printf("%-14s %5d frames  raw %9ld bytes  sent %9ld (%5.1f%%)  "
+         "%d mismatched, %d bigger than raw\n", name, frames, raw, wire,
+         100.0*wire/raw, mismatches, bigger);
+  return mismatches || bigger;
+}
+
+int main(int argc, char* argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 100;
+  int mix_kinds[] = {0, 1, 2, 3};
+  u16 mix_counts[] = {600, 318, 318, 134};
+  int noise_kinds[] = {3};
+  int flat_kinds[] = {0};
+  u16 full_counts[] = {MAX_PIXELS};
+  int listener, from, to, failed = 0;
+  opc_source source;
+  opc_sink sink;
+
+  listener = listen_on(SINK_PORT);
+  source = opc_new_source(SOURCE_PORT);
+  sink = opc_new_sink("127.0.0.1", SINK_PORT);
+  opc_set_compression(sink, 1);
+  opc_connect(sink);
+  from = accept(listener, NULL, NULL);
+  to = connect_to(SOURCE_PORT);
+
+  failed |= run("mixed", sink, from, to, source, frames, 4,
+                mix_kinds, mix_counts);
+  failed |= run("flat 21845", sink, from, to, source, frames, 1,
+                flat_kinds, full_counts);
+  failed |= run("noise 21845", sink, from, to, source, frames, 1,
+                noise_kinds, full_counts);
+  return failed;
+}
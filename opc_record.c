@@ -0,0 +1,47 @@
+// Records the OPC stream arriving on a port, for replay with opc_replay.
+//
+//   gcc -std=c99 -O3 -o record opc_record.c opc_server.c recorder.c frame_clock.c
+//   ./record 7890 show.rec
+//
+// Recording stops on Ctrl-C.  A new frame starts whenever an address
+// repeats, so each frame holds one message per address.
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "opc.h"
+#include "recorder.h"
+
+static volatile sig_atomic_t stopped = 0;
+static int num_messages = 0;
+
+void handler(u8 address, u16 count, pixel* pixels) {
+  recorder_put_pixels(address, count, (u8*) pixels);
+  num_messages++;
+}
+
+void stop(int signal) {
+  stopped = 1;
+}
+
+int main(int argc, char** argv) {
+  u16 port = argc > 1 ? atoi(argv[1]) : 0;
+  opc_source source;
+
+  if (!port || argc < 3) {
+    fprintf(stderr, "Usage: %s <port> <filename>\n", argv[0]);
+    return 1;
+  }
+  source = opc_new_source(port);
+  if (source < 0 || !recorder_open(argv[2])) {
+    return 1;
+  }
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+  while (!stopped) {
+    opc_receive(source, handler, 100);
+  }
+  recorder_close();
+  fprintf(stderr, "Recorded %d messages to %s\n", num_messages, argv[2]);
+  return 0;
+}
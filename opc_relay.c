@@ -0,0 +1,101 @@
+// Relays one OPC stream to any number of OPC receivers, e.g. to both
+// serpents, or to spidev_server and opengl_server at once.
+//
+//   gcc -std=c99 -O3 -o relay opc_relay.c opc_server.c opc_client.c -lpthread
+//   ./relay 7890 192.168.1.10:7890 127.0.0.1:7891/drop
+//
+// Each message is forwarded straight out of the receive buffer.  Every sink
+// has its own backpressure policy (see opc.h), chosen with a suffix:
+//   /drop   drop messages that the receiver cannot take right now (default)
+//   /queue  queue them, up to RELAY_QUEUE_LIMIT bytes
+//   /block  wait for the receiver; this stalls the other sinks too
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "opc.h"
+
+#define RELAY_QUEUE_LIMIT (1 << 20)
+#define RELAY_STATS_INTERVAL 10  // seconds
+
+static opc_sink sinks[OPC_MAX_SINKS];
+static char* sink_names[OPC_MAX_SINKS];
+static int sink_blocks[OPC_MAX_SINKS];
+static int num_sinks = 0;
+
+void relay(u8 address, u16 count, pixel* pixels) {
+  int i;
+
+  for (i = 0; i < num_sinks; i++) {
+    opc_put_pixels(sinks[i], address, count, pixels);
+  }
+}
+
+// Parses "host:port[/policy]" and creates the next sink.
+opc_sink new_sink(char* spec) {
+  char host[64];
+  char* colon = strchr(spec, ':');
+  char* slash = strchr(spec, '/');
+  char* policy = slash ? slash + 1 : "drop";
+
+  if (!colon || colon - spec >= sizeof(host)) {
+    return -1;
+  }
+  strncpy(host, spec, colon - spec);
+  host[colon - spec] = 0;
+  sink_blocks[num_sinks] = !strcmp(policy, "block");
+  if (sink_blocks[num_sinks]) {
+    return opc_new_sink(host, atoi(colon + 1));
+  }
+  if (!strcmp(policy, "queue")) {
+    return opc_new_nonblocking_sink(
+        host, atoi(colon + 1), OPC_QUEUE, RELAY_QUEUE_LIMIT);
+  }
+  if (!strcmp(policy, "drop")) {
+    return opc_new_nonblocking_sink(host, atoi(colon + 1), OPC_DROP, 0);
+  }
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  u16 port = argc > 1 ? atoi(argv[1]) : 0;
+  opc_source source;
+  opc_sink_stats stats;
+  time_t next_report = time(NULL) + RELAY_STATS_INTERVAL;
+  int i;
+
+  if (!port || argc < 3 || argc - 2 > OPC_MAX_SINKS) {
+    fprintf(stderr, "Usage: %s <port> <host>:<port>[/drop|/queue|/block] "
+            "...\n", argv[0]);
+    return 1;
+  }
+  for (i = 2; i < argc; i++) {
+    sinks[num_sinks] = new_sink(argv[i]);
+    if (sinks[num_sinks] < 0) {
+      fprintf(stderr, "Bad destination: %s\n", argv[i]);
+      return 1;
+    }
+    sink_names[num_sinks++] = argv[i];
+  }
+
+  source = opc_new_source(port);
+  while (source >= 0) {
+    opc_receive(source, relay, 10);
+    for (i = 0; i < num_sinks; i++) {
+      opc_flush(sinks[i]);
+    }
+    if (time(NULL) >= next_report) {
+      for (i = 0; i < num_sinks; i++) {
+        if (sink_blocks[i]) {
+          continue;  // blocking sinks never drop anything
+        }
+        opc_get_sink_stats(sinks[i], &stats);
+        fprintf(stderr, "%s: %d sent, %d dropped\n",
+                sink_names[i], stats.frames_sent, stats.frames_dropped);
+      }
+      next_report += RELAY_STATS_INTERVAL;
+    }
+  }
+  return 1;
+}
@@ -0,0 +1,168 @@
+// Replays a recording made by opc_record (or serpent_tcp's SERPENT_RECORD)
+// to an OPC receiver, and reports the rate it achieved.
+//
+//   gcc -std=c99 -O3 -o replay opc_replay.c opc_client.c frame_clock.c -lpthread
+//   ./replay show.rec 127.0.0.1 7890        # original timing
+//   ./replay show.rec 127.0.0.1 7890 4      # 4x speed
+//   ./replay show.rec 127.0.0.1 7890 0      # as fast as possible
+//
+// The file is mapped into memory and pixels are sent from it in place.
+// Frames that lie outside the file, or whose messages run past the end of
+// the frame, are skipped, so a damaged recording cannot crash the replay.
+
+#define _XOPEN_SOURCE 500  // for usleep
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "frame_clock.h"
+#include "opc.h"
+#include "recorder.h"
+
+double get_time() {
+  return frame_clock_now_ns()*1e-9;
+}
+
+// Returns the frame at 'offset', or NULL if it does not lie wholly inside
+// the file.
+recording_frame* get_frame(u8* data, u64 size, u64 offset) {
+  recording_frame* frame;
+
+  if (offset < sizeof(recording_header) || offset % 8 ||
+      offset > size - sizeof(recording_frame)) {
+    return NULL;
+  }
+  frame = (recording_frame*) (data + offset);
+  if (frame->length > size - offset - sizeof(recording_frame)) {
+    return NULL;
+  }
+  return frame;
+}
+
+// Finds all the frames in a mapped recording, from the index if it has one
+// or by walking the frames if not.  Returns the number of frames.
+u64 load_index(u8* data, u64 size, u64** offsets) {
+  recording_trailer* trailer = (recording_trailer*) (data + size) - 1;
+  recording_frame* frame;
+  u64 offset, num_frames = 0, capacity = 0;
+  u64* grown;
+
+  // The frame offsets in the index are checked as they are used.
+  if (size >= sizeof(recording_header) + sizeof(recording_trailer) &&
+      !memcmp(trailer->magic, RECORDING_INDEX_MAGIC, 8) &&
+      trailer->index_offset % 8 == 0 &&
+      trailer->index_offset <= size - sizeof(recording_trailer) &&
+      trailer->num_frames <= (size - sizeof(recording_trailer) -
+                              trailer->index_offset) / sizeof(u64)) {
+    *offsets = (u64*) (data + trailer->index_offset);
+    return trailer->num_frames;
+  }
+
+  fprintf(stderr, "No index; scanning frames\n");
+  *offsets = NULL;
+  offset = sizeof(recording_header);
+  while ((frame = get_frame(data, size, offset))) {  // NULL if cut off
+    if (num_frames >= capacity) {
+      capacity = capacity ? capacity*2 : 1024;
+      grown = realloc(*offsets, capacity*sizeof(u64));
+      if (!grown) {
+        fprintf(stderr, "Out of memory; replaying the first %llu frames\n",
+                (unsigned long long) num_frames);
+        break;
+      }
+      *offsets = grown;
+    }
+    (*offsets)[num_frames++] = offset;
+    offset += sizeof(recording_frame) + (((u64) frame->length + 7) & ~7);
+  }
+  return num_frames;
+}
+
+int main(int argc, char** argv) {
+  double speed = argc > 4 ? atof(argv[4]) : 1;
+  u8 addresses[256];
+  u16 counts[256];
+  pixel* pixels[256];
+  struct stat st;
+  recording_frame* frame;
+  u64* offsets;
+  u64 num_frames, f, bytes = 0, bad_frames = 0;
+  u8* data;
+  u8* d;
+  u8* end;
+  u16 length;
+  double start, delay, elapsed;
+  int fd, m;
+  opc_sink sink;
+
+  if (argc < 4) {
+    fprintf(stderr, "Usage: %s <filename> <host> <port> [<speed>]\n", argv[0]);
+    return 1;
+  }
+  fd = open(argv[1], O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED || st.st_size < sizeof(recording_header) ||
+      memcmp(data, RECORDING_MAGIC, 8)) {
+    fprintf(stderr, "%s is not a recording\n", argv[1]);
+    return 1;
+  }
+  num_frames = load_index(data, st.st_size, &offsets);
+  sink = opc_new_sink(argv[2], atoi(argv[3]));
+  if (sink < 0) {
+    return 1;
+  }
+  opc_connect(sink);
+
+  start = get_time();
+  for (f = 0; f < num_frames; f++) {
+    frame = get_frame(data, st.st_size, offsets[f]);
+    if (!frame) {
+      bad_frames++;
+      continue;
+    }
+    if (speed > 0) {
+      delay = start + frame->time_us*1e-6/speed - get_time();
+      if (delay > 0) {
+        usleep((int) (delay*1e6));
+      }
+    }
+    d = (u8*) (frame + 1);
+    end = d + frame->length;
+    for (m = 0; m < frame->num_messages && m < 256; m++) {
+      if (end - d < 4) {
+        break;
+      }
+      length = (d[2] << 8) | d[3];
+      if (end - d - 4 < length) {
+        break;
+      }
+      addresses[m] = d[0];
+      counts[m] = length / 3;
+      pixels[m] = (pixel*) (d + 4);
+      d += 4 + length;
+    }
+    if (m < frame->num_messages && m < 256) {
+      bad_frames++;
+      continue;
+    }
+    opc_put_frame(sink, m, addresses, counts, pixels);
+    bytes += frame->length;
+  }
+  elapsed = get_time() - start;
+
+  printf("%llu frames, %llu bytes in %.3f s: %.1f frames/s, %.3f MB/s\n",
+         (unsigned long long) num_frames, (unsigned long long) bytes, elapsed,
+         num_frames/elapsed, bytes/elapsed/1e6);
+  if (bad_frames) {
+    fprintf(stderr, "%llu frames were damaged\n",
+            (unsigned long long) bad_frames);
+  }
+  return 0;
+}
@@ -1,25 +1,136 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "opc.h"
 
-/* Internal structure for a source.  sock >= 0 iff the connection is open. */
+/* Maximum number of events to handle in one call to opc_receive. */
+#define OPC_MAX_EVENTS 64
+
+/* Initial size of a client's receive buffer.  It grows, a power of two at */
+/* a time, whenever a message would not fit; the largest possible message */
+/* is 4 + 0xffff bytes. */
+#define OPC_INITIAL_BUFFER_SIZE (1 << 14)
+
+/* Maximum number of recv() calls for one client per event, so that one busy */
+/* client cannot starve the others. */
+#define OPC_MAX_READS 8
+
+/* Pixels last set on each address by a compressed command, which is what */
+/* an OPC_SET_PIXELS_DELTA message is applied to. */
+typedef struct {
+  pixel* pixels[256];
+  u16 counts[256];
+} opc_decoder;
+
+/* Internal structure for one client connection on a source.  buffer holds */
+/* 'length' bytes of unparsed data, always starting at a message boundary. */
+typedef struct {
+  int sock;
+  opc_decoder decoder;
+  u32 length;
+  u32 capacity;
+  u8* buffer;
+} opc_client_info;
+
+/* Largest frame that a UDP source can reassemble.  The frame buffer starts */
+/* at OPC_INITIAL_BUFFER_SIZE and grows as needed. */
+#define OPC_UDP_MAX_FRAME (1 << 20)
+
+/* Maximum number of datagrams to read from a UDP source per event. */
+#define OPC_MAX_DATAGRAMS 256
+
+/* A UDP frame whose sequence number is at most this far behind the last */
+/* delivered frame is late and is dropped; anything further behind means the */
+/* sender has restarted its count.  A restarted sender usually also has a */
+/* new port, which resets the count immediately. */
+#define OPC_UDP_LATE_WINDOW 256
+
+/* Internal structure for a source.  listen_sock stays open for as long as */
+/* the source exists; clients are tracked by the epoll set in epoll_fd.  For */
+/* a UDP source, listen_sock is the datagram socket and 'frame' collects the */
+/* fragments of the frame numbered 'sequence', of which 'next_fragment' is */
+/* the next one expected. */
 typedef struct {
   u16 port;
   int listen_sock;
-  int sock;
-  u16 header_length;
-  u8 header[4];
-  u16 payload_length;
-  u8 payload[1 << 16];
+  int epoll_fd;
+  int num_clients;
+  int udp;
+  u8* frame;
+  u32 frame_length;
+  u32 frame_capacity;
+  int assembling;
+  u32 sequence;
+  u16 next_fragment;
+  int delivered;
+  u32 last_sequence;
+  struct sockaddr_in sender;
+  opc_decoder decoder;
 } opc_source_info;
 
-static opc_source_info opc_sources[OPC_MAX_SOURCES];
+/* Sources are allocated as they are created; opc_sources grows to match. */
+static opc_source_info** opc_sources = NULL;
+static int opc_sources_capacity = 0;
 static int opc_next_source = 0;
+static int opc_max_sources = OPC_MAX_SOURCES;
+
+void opc_set_max_sources(int max_sources) {
+  opc_max_sources = max_sources;
+}
+
+/* Grows a buffer to at least 'needed' bytes by doubling, keeping the first */
+/* 'length' bytes.  Returns 0 if memory could not be allocated. */
+static int opc_grow(u8** buffer, u32* capacity, u32 needed) {
+  u32 size = *capacity ? *capacity : OPC_INITIAL_BUFFER_SIZE;
+  u8* grown;
+
+  while (size < needed) {
+    size *= 2;
+  }
+  if (size == *capacity) {
+    return 1;
+  }
+  grown = realloc(*buffer, size);
+  if (!grown) {
+    fprintf(stderr, "OPC: Out of memory for a %d-byte buffer\n", size);
+    return 0;
+  }
+  *buffer = grown;
+  *capacity = size;
+  return 1;
+}
+
+/* Allocates a zeroed opc_source_info, if the limit allows another source. */
+static opc_source_info* opc_alloc_source(u16 port) {
+  opc_source_info* info;
+
+  if (opc_next_source >= opc_max_sources) {
+    fprintf(stderr, "OPC: No more sources available\n");
+    return NULL;
+  }
+  info = calloc(1, sizeof(opc_source_info));
+  if (!info) {
+    fprintf(stderr, "OPC: Out of memory for new source\n");
+    return NULL;
+  }
+  info->port = port;
+  return info;
+}
+
+static int opc_set_nonblocking(int sock) {
+  int flags = fcntl(sock, F_GETFL, 0);
+  return flags < 0 ? -1 : fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+}
 
 int opc_listen(u16 port) {
   struct sockaddr_in address;
@@ -35,111 +146,432 @@ int opc_listen(u16 port) {
   if (bind(sock, (struct sockaddr*) &address, sizeof(address)) != 0) {
     fprintf(stderr, "OPC: Could not bind to port %d: ", port);
     perror(NULL);
+    close(sock);
     return -1;
   }
-  if (listen(sock, 0) != 0) {
+  if (listen(sock, SOMAXCONN) != 0) {
     fprintf(stderr, "OPC: Could not listen on port %d: ", port);
     perror(NULL);
+    close(sock);
     return -1;
   }
+  /* accept() must not block if a client goes away before we get to it. */
+  opc_set_nonblocking(sock);
   return sock;
 }
 
+static int opc_bind_udp(u16 port) {
+  struct sockaddr_in address;
+  int sock;
+  int size = OPC_UDP_MAX_FRAME;
+
+  sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  /* Leave room for a few whole frames if we fall behind briefly. */
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  bzero(&address.sin_addr, sizeof(address.sin_addr));
+  if (bind(sock, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    fprintf(stderr, "OPC: Could not bind to UDP port %d: ", port);
+    perror(NULL);
+    close(sock);
+    return -1;
+  }
+  opc_set_nonblocking(sock);
+  return sock;
+}
+
+/* Sets up the epoll set for a source whose listen_sock is already open. */
+/* The listening socket is the only entry with a NULL data pointer. */
+/* On failure, the socket and info are freed. */
+static opc_source opc_add_source(opc_source_info* info) {
+  struct epoll_event event;
+  opc_source_info** sources;
+  int capacity;
+
+  if (opc_next_source >= opc_sources_capacity) {
+    capacity = opc_sources_capacity ? opc_sources_capacity*2 : 4;
+    sources = realloc(opc_sources, capacity*sizeof(opc_source_info*));
+    if (!sources) {
+      fprintf(stderr, "OPC: Out of memory for new source\n");
+      close(info->listen_sock);
+      free(info->frame);
+      free(info);
+      return -1;
+    }
+    opc_sources = sources;
+    opc_sources_capacity = capacity;
+  }
+
+  info->epoll_fd = epoll_create(OPC_MAX_EVENTS);
+  if (info->epoll_fd < 0) {
+    perror("OPC: Could not create epoll set");
+    close(info->listen_sock);
+    free(info->frame);
+    free(info);
+    return -1;
+  }
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, info->listen_sock, &event);
+
+  /* Increment opc_next_source only if we were successful. */
+  fprintf(stderr, "OPC: Listening on %s port %d\n",
+          info->udp ? "UDP" : "TCP", info->port);
+  opc_sources[opc_next_source] = info;
+  return opc_next_source++;
+}
+
 opc_source opc_new_source(u16 port) {
-  opc_source_info* info;
+  opc_source_info* info = opc_alloc_source(port);
 
-  /* Allocate an opc_source_info entry. */
-  if (opc_next_source >= OPC_MAX_SOURCES) {
-    fprintf(stderr, "OPC: No more sources available\n");
+  if (!info) {
     return -1;
   }
-  info = &opc_sources[opc_next_source];
 
   /* Listen on the specified port. */
-  info->port = port;
   info->listen_sock = opc_listen(port);
   if (info->listen_sock < 0) {
+    free(info);
     return -1;
   }
+  return opc_add_source(info);
+}
 
-  /* Increment opc_next_source only if we were successful. */
-  fprintf(stderr, "OPC: Listening on port %d\n", port);
-  return opc_next_source++;
+opc_source opc_new_udp_source(u16 port) {
+  opc_source_info* info = opc_alloc_source(port);
+
+  if (!info) {
+    return -1;
+  }
+  info->udp = 1;
+  info->listen_sock = opc_bind_udp(port);
+  if (info->listen_sock < 0) {
+    free(info);
+    return -1;
+  }
+  return opc_add_source(info);
 }
 
-void opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
-  int nfds;
-  fd_set readfds;
-  struct timeval timeout;
-  opc_source_info* info = &opc_sources[source];
+static void opc_accept(opc_source_info* info) {
   struct sockaddr_in address;
-  socklen_t address_len = sizeof(address);
-  u16 payload_expected;
-  ssize_t received = 0;
+  socklen_t address_len;
+  struct epoll_event event;
+  opc_client_info* client;
   char buffer[64];
+  int sock;
 
-  if (source < 0 || source >= opc_next_source) {
-    fprintf(stderr, "OPC: Source %d does not exist\n", source);
-    return;
+  /* Accept every connection that is waiting, not just the first. */
+  while (1) {
+    address_len = sizeof(address);
+    sock = accept(info->listen_sock, (struct sockaddr*) &address, &address_len);
+    if (sock < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("OPC: Could not accept connection");
+      }
+      return;
+    }
+    client = calloc(1, sizeof(opc_client_info));
+    if (!client || !opc_grow(&client->buffer, &client->capacity, 0)) {
+      fprintf(stderr, "OPC: Out of memory for new client\n");
+      free(client);
+      close(sock);
+      continue;
+    }
+    client->sock = sock;
+    opc_set_nonblocking(sock);
+    event.events = EPOLLIN;
+    event.data.ptr = client;
+    if (epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0) {
+      perror("OPC: Could not watch client");
+      close(sock);
+      free(client->buffer);
+      free(client);
+      continue;
+    }
+    info->num_clients++;
+    inet_ntop(AF_INET, &(address.sin_addr), buffer, 64);
+    fprintf(stderr, "OPC: Client connected from %s (%d connected)\n",
+            buffer, info->num_clients);
   }
+}
 
-  /* Select for inbound data or connections. */
-  FD_ZERO(&readfds);
-  if (info->listen_sock >= 0) {
-    FD_SET(info->listen_sock, &readfds);
-    nfds = info->listen_sock + 1;
-  } else if (info->sock >= 0) {
-    FD_SET(info->sock, &readfds);
-    nfds = info->sock + 1;
-  }
-  timeout.tv_sec = timeout_ms / 1000;
-  timeout.tv_usec = (timeout_ms % 1000) * 1000;
-  if (select(nfds, &readfds, NULL, NULL, &timeout) > 0) {
-    if (info->listen_sock >= 0 && FD_ISSET(info->listen_sock, &readfds)) {
-      /* Handle an inbound connection. */
-      info->sock = accept(
-          info->listen_sock, (struct sockaddr*) &(address), &address_len);
-      inet_ntop(AF_INET, &(address.sin_addr), buffer, 64);
-      fprintf(stderr, "OPC: Client connected from %s\n", buffer);
-      close(info->listen_sock);
-      info->listen_sock = -1;
-      info->header_length = 0;
-      info->payload_length = 0;
-    }
-    if (info->sock >= 0 && FD_ISSET(info->sock, &readfds)) {
-      /* Handle inbound data on an existing connection. */
-      if (info->header_length < 4) {  /* need header */
-        received = recv(info->sock, info->header + info->header_length,
-                        4 - info->header_length, 0);
-        if (received > 0) {
-          info->header_length += received;
+static void opc_close_client(opc_source_info* info, opc_client_info* client) {
+  int a;
+
+  /* Closing the socket also removes it from the epoll set. */
+  close(client->sock);
+  for (a = 0; a < 256; a++) {
+    free(client->decoder.pixels[a]);
+  }
+  free(client->buffer);
+  free(client);
+  info->num_clients--;
+  fprintf(stderr, "OPC: Client closed connection (%d connected)\n",
+          info->num_clients);
+}
+
+/* Decodes an OPC_SET_PIXELS_RLE or OPC_SET_PIXELS_DELTA payload into the */
+/* decoder's pixels for 'address'.  Returns the pixel count, or -1 if the */
+/* payload is malformed. */
+static int opc_decode(opc_decoder* decoder, u8 address, u8 command,
+                      u8* data, u16 length) {
+  u8* end = data + length;
+  u8* out;
+  u8* stop;
+  pixel* p;
+  u16 count;
+  int n, i;
+
+  if (length < 2) {
+    return -1;
+  }
+  count = (data[0] << 8) | data[1];
+  data += 2;
+  if (decoder->counts[address] != count || !decoder->pixels[address]) {
+    p = realloc(decoder->pixels[address], count*3 + 1);
+    if (!p) {
+      fprintf(stderr, "OPC: Out of memory for %d pixels\n", count);
+      return -1;
+    }
+    /* A delta against no previous frame is a delta against black. */
+    memset(p, 0, count*3);
+    decoder->pixels[address] = p;
+    decoder->counts[address] = count;
+  }
+  out = (u8*) decoder->pixels[address];
+  stop = out + count*3;
+
+  while (out < stop) {
+    if (data >= end) {
+      return -1;
+    }
+    if (*data < 128) {  /* literal pixels */
+      n = (*data++ + 1)*3;
+      if (end - data < n || stop - out < n) {
+        return -1;
+      }
+      if (command == OPC_SET_PIXELS_DELTA) {
+        for (i = 0; i < n; i++) {
+          out[i] ^= data[i];
         }
       } else {
-        payload_expected = (info->header[2] << 8) | info->header[3];
-        if (info->payload_length < payload_expected) {  /* need payload */
-          received = recv(info->sock, info->payload + info->payload_length,
-                          payload_expected - info->payload_length, 0);
-          if (received > 0) {
-            info->payload_length += received;
-          }
-        }
-        if (info->header_length == 4 &&
-            info->payload_length == payload_expected) {  /* payload complete */
-          if (info->header[1] == OPC_SET_PIXELS) {
-            handler(info->header[0], payload_expected / 3,
-                    (pixel*) info->payload);
-          }
-          info->header_length = 0;
-          info->payload_length = 0;
+        memcpy(out, data, n);
+      }
+      data += n;
+      out += n;
+    } else {  /* one pixel repeated */
+      n = *data++ - 126;
+      if (end - data < 3 || stop - out < n*3) {
+        return -1;
+      }
+      for (i = 0; i < n; i++, out += 3) {
+        if (command == OPC_SET_PIXELS_DELTA) {
+          out[0] ^= data[0];
+          out[1] ^= data[1];
+          out[2] ^= data[2];
+        } else {
+          out[0] = data[0];
+          out[1] = data[1];
+          out[2] = data[2];
         }
       }
-      if (received <= 0) {
-        /* Connection was closed; wait for more connections. */
-        fprintf(stderr, "OPC: Client closed connection\n");
-        close(info->sock);
-        info->sock = -1;
-        info->listen_sock = opc_listen(info->port);
+      data += 3;
+    }
+  }
+  return count;
+}
+
+/* Calls the handler for every complete message in [data, end), in place. */
+/* Compressed messages are rebuilt in the decoder first.  Returns a pointer */
+/* to the first byte of any trailing partial message. */
+static u8* opc_parse(u8* data, u8* end, opc_handler* handler,
+                     opc_decoder* decoder) {
+  u16 payload_length;
+  int count;
+
+  while (end - data >= 4) {
+    payload_length = (data[2] << 8) | data[3];
+    if (end - data < 4 + payload_length) {
+      break;
+    }
+    if (data[1] == OPC_SET_PIXELS) {
+      handler(data[0], payload_length / 3, (pixel*) (data + 4));
+    } else if (data[1] == OPC_SET_PIXELS_RLE ||
+               data[1] == OPC_SET_PIXELS_DELTA) {
+      count = opc_decode(decoder, data[0], data[1], data + 4, payload_length);
+      if (count >= 0) {
+        handler(data[0], count, decoder->pixels[data[0]]);
+      } else {
+        fprintf(stderr, "OPC: Malformed compressed message for address %d\n",
+                data[0]);
+        decoder->counts[data[0]] = 0;
       }
     }
+    data += 4 + payload_length;
+  }
+  return data;
+}
+
+/* Reads from one client, returning 0 if the connection has been closed. */
+static int opc_read_client(opc_client_info* client, opc_handler* handler) {
+  ssize_t received;
+  u32 wanted;
+  u8* end;
+  u8* rest;
+  int reads;
+
+  for (reads = 0; reads < OPC_MAX_READS; reads++) {
+    wanted = client->capacity - client->length;
+    received = recv(client->sock, client->buffer + client->length, wanted, 0);
+    if (received < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    if (received == 0) {
+      return 0;
+    }
+
+    /* Dispatch everything that is complete, then keep the remainder. */
+    end = client->buffer + client->length + received;
+    rest = opc_parse(client->buffer, end, handler, &client->decoder);
+    client->length = end - rest;
+    if (client->length > 0 && rest > client->buffer) {
+      memmove(client->buffer, rest, client->length);
+    }
+
+    /* Make room for the whole of a partial message that will not fit. */
+    if (client->length >= 4 && !opc_grow(&client->buffer, &client->capacity,
+        4 + ((client->buffer[2] << 8) | client->buffer[3]))) {
+      return 0;
+    }
+
+    /* A short read means the socket has been drained. */
+    if (received < wanted) {
+      break;
+    }
+  }
+  return 1;
+}
+
+/* Returns 1 if a datagram for frame 'sequence' should be dropped because */
+/* that frame is no newer than the last one delivered. */
+static int opc_is_late(opc_source_info* info, u32 sequence) {
+  u32 behind = info->last_sequence - sequence;
+  return info->delivered && behind < OPC_UDP_LATE_WINDOW;
+}
+
+/* Reads waiting datagrams on a UDP source, reassembling them directly in */
+/* the frame buffer and calling the handler once a frame is complete. */
+static void opc_read_datagrams(opc_source_info* info, opc_handler* handler) {
+  u8 header[OPC_UDP_HEADER_SIZE];
+  struct iovec iov[2];
+  struct msghdr message;
+  struct sockaddr_in sender;
+  ssize_t received;
+  u32 sequence, payload_length;
+  u16 fragment;
+  int i;
+
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = iov;
+  message.msg_iovlen = 2;
+  message.msg_name = &sender;
+  for (i = 0; i < OPC_MAX_DATAGRAMS; i++) {
+    /* Receive the payload where it belongs if it continues this frame. */
+    if (!info->assembling) {
+      info->frame_length = 0;
+    }
+    if (info->frame_length + OPC_UDP_MAX_DATAGRAM > OPC_UDP_MAX_FRAME) {
+      info->assembling = 0;  /* too long; drop it */
+      info->frame_length = 0;
+    }
+    if (!opc_grow(&info->frame, &info->frame_capacity,
+                  info->frame_length + OPC_UDP_MAX_DATAGRAM)) {
+      return;
+    }
+    iov[0].iov_base = header;
+    iov[0].iov_len = OPC_UDP_HEADER_SIZE;
+    iov[1].iov_base = info->frame + info->frame_length;
+    iov[1].iov_len = info->frame_capacity - info->frame_length;
+    message.msg_namelen = sizeof(sender);
+    message.msg_flags = 0;
+    received = recvmsg(info->listen_sock, &message, 0);
+    if (received < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("OPC: Error receiving datagram");
+      }
+      return;
+    }
+    if (received < OPC_UDP_HEADER_SIZE || (message.msg_flags & MSG_TRUNC)) {
+      info->assembling = 0;
+      continue;
+    }
+    sequence = (header[0] << 24) | (header[1] << 16) |
+        (header[2] << 8) | header[3];
+    fragment = (header[4] << 8) | header[5];
+    payload_length = received - OPC_UDP_HEADER_SIZE;
+    if (sender.sin_port != info->sender.sin_port ||
+        sender.sin_addr.s_addr != info->sender.sin_addr.s_addr) {
+      info->sender = sender;
+      info->delivered = 0;
+    }
+    if (opc_is_late(info, sequence)) {
+      continue;
+    }
+
+    if (fragment == 0) {
+      /* A new frame; any partial frame in progress is abandoned. */
+      if (info->frame_length > 0) {
+        memmove(info->frame, info->frame + info->frame_length, payload_length);
+      }
+      info->frame_length = 0;
+      info->sequence = sequence;
+      info->next_fragment = 0;
+      info->assembling = 1;
+    } else if (!info->assembling || sequence != info->sequence ||
+               fragment != info->next_fragment) {
+      /* A fragment went missing or arrived out of order. */
+      info->assembling = 0;
+      continue;
+    }
+    info->frame_length += payload_length;
+    info->next_fragment++;
+
+    if (header[6] & OPC_UDP_END_OF_FRAME) {
+      opc_parse(info->frame, info->frame + info->frame_length, handler,
+                &info->decoder);
+      info->last_sequence = sequence;
+      info->delivered = 1;
+      info->assembling = 0;
+    }
+  }
+}
+
+void opc_receive(opc_source source, opc_handler* handler, u32 timeout_ms) {
+  struct epoll_event events[OPC_MAX_EVENTS];
+  opc_source_info* info;
+  opc_client_info* client;
+  int i, count;
+
+  if (source < 0 || source >= opc_next_source) {
+    fprintf(stderr, "OPC: Source %d does not exist\n", source);
+    return;
+  }
+  info = opc_sources[source];
+
+  /* Wait for inbound data, datagrams or connections. */
+  count = epoll_wait(info->epoll_fd, events, OPC_MAX_EVENTS, timeout_ms);
+  for (i = 0; i < count; i++) {
+    client = events[i].data.ptr;
+    if (!client && info->udp) {
+      opc_read_datagrams(info, handler);
+    } else if (!client) {
+      /* Handle inbound connections. */
+      opc_accept(info);
+    } else if (!opc_read_client(client, handler)) {
+      /* Connection was closed; other clients are unaffected. */
+      opc_close_client(info, client);
+    }
   }
 }
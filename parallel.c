@@ -0,0 +1,129 @@
+#define _DEFAULT_SOURCE 1
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "parallel.h"
+
+#define PARALLEL_MAX_THREADS 64
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[PARALLEL_MAX_THREADS];
+static int num_threads = 0;  /* 0 until the pool is set up */
+static int stopping = 0;
+
+/* The current job.  It is set up under the lock, and every worker reports */
+/* back for each one, so no worker can still be on an old job when the */
+/* next one starts. */
+static int generation = 0;
+static parallel_func* job_func;
+static void* job_context;
+static int job_count, job_blocks;
+static int next_block;  /* taken with __sync_fetch_and_add */
+static int workers_done;
+
+static void parallel_run_blocks() {
+  int b;
+
+  while ((b = __sync_fetch_and_add(&next_block, 1)) < job_blocks) {
+    job_func(job_context, job_count*b/job_blocks,
+             job_count*(b + 1)/job_blocks);
+  }
+}
+
+/* arg is the generation when the worker was created, so that a job */
+/* posted before the worker first takes the lock is not missed. */
+static void* parallel_worker(void* arg) {
+  int seen = (intptr_t) arg;
+
+  pthread_mutex_lock(&lock);
+  while (1) {
+    while (generation == seen && !stopping) {
+      pthread_cond_wait(&work_ready, &lock);
+    }
+    if (stopping) {
+      break;
+    }
+    seen = generation;
+    pthread_mutex_unlock(&lock);
+    parallel_run_blocks();
+    pthread_mutex_lock(&lock);
+    if (++workers_done == num_threads - 1) {
+      pthread_cond_signal(&work_done);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+void parallel_set_threads(int threads) {
+  int w;
+
+  if (threads < 1) {
+    threads = 1;
+  }
+  if (threads > PARALLEL_MAX_THREADS) {
+    threads = PARALLEL_MAX_THREADS;
+  }
+  if (num_threads > 1) {
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&work_ready);
+    pthread_mutex_unlock(&lock);
+    for (w = 0; w < num_threads - 1; w++) {
+      pthread_join(workers[w], NULL);
+    }
+    stopping = 0;
+  }
+  for (w = 0; w < threads - 1; w++) {
+    if (pthread_create(&workers[w], NULL, parallel_worker,
+                       (void*) (intptr_t) generation) != 0) {
+      perror("Could not start worker thread");
+      break;
+    }
+  }
+  num_threads = w + 1;
+}
+
+int parallel_get_threads() {
+  char* value;
+
+  if (!num_threads) {
+    value = getenv("SERPENT_THREADS");
+    parallel_set_threads(value ? atoi(value) : sysconf(_SC_NPROCESSORS_ONLN));
+  }
+  return num_threads;
+}
+
+void parallel_for(int count, int blocks, parallel_func* func, void* context) {
+  int b;
+
+  if (parallel_get_threads() == 1 || blocks <= 1) {
+    for (b = 0; b < blocks; b++) {
+      func(context, count*b/blocks, count*(b + 1)/blocks);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  job_func = func;
+  job_context = context;
+  job_count = count;
+  job_blocks = blocks;
+  next_block = 0;
+  workers_done = 0;
+  generation++;
+  pthread_cond_broadcast(&work_ready);
+  pthread_mutex_unlock(&lock);
+
+  parallel_run_blocks();
+
+  pthread_mutex_lock(&lock);
+  while (workers_done < num_threads - 1) {
+    pthread_cond_wait(&work_done, &lock);
+  }
+  pthread_mutex_unlock(&lock);
+}
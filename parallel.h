@@ -0,0 +1,23 @@
+// A persistent pool of worker threads for splitting a frame's pixels into
+// blocks and rendering the blocks at the same time.
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+/* Renders items [start, end) of the range given to parallel_for(). */
+typedef void parallel_func(void* context, int start, int end);
+
+/* Sets the number of threads that share the work, counting the caller, and */
+/* starts or stops workers to match.  Until this is called, the pool uses */
+/* SERPENT_THREADS from the environment, or one thread per online CPU. */
+void parallel_set_threads(int threads);
+
+/* Returns the number of threads that share the work, counting the caller. */
+int parallel_get_threads();
+
+/* Splits [0, count) into 'blocks' equal contiguous blocks and calls func */
+/* once per block, on the workers and the calling thread.  Returns when */
+/* every block is done.  Where each block starts and ends depends only on */
+/* 'count' and 'blocks', so the result does not depend on the threads. */
+void parallel_for(int count, int blocks, parallel_func* func, void* context);
+
+#endif  /* PARALLEL_H */
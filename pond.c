@@ -71,7 +71,15 @@ unsigned char pond_env_map[2400];
 typedef unsigned short word;
 
 void next_frame(int f) {
-  float t = POND_TIME_SPEEDUP * (float) f / FPS;
+  static float seconds = 0;  // since frame 0
+  float dt = get_frame_seconds();
+  float t;
+
+  if (f == 0) {
+    seconds = 0;
+  }
+  t = POND_TIME_SPEEDUP * seconds;
+  seconds += dt;
   if (f == 0) {
     for (int e = 0; e < 400; e++) {
       pond_env_map[e*3] = e/2;
@@ -123,7 +131,8 @@ void next_frame(int f) {
       pond_drop_y = rand() % NUM_COLUMNS;
       pond_drop_impulse = -pond_drop_impulse;
     }
-    float k = sin(duty_phase/POND_DUTY_CYCLE_ON*M_PI);
+    // The drop pushes for as long as it is on, however many frames that is.
+    float k = sin(duty_phase/POND_DUTY_CYCLE_ON*M_PI)*dt*FPS;
     pond_velocity[pond_drop_x][pond_drop_y] += pond_drop_impulse*k;
     pond_velocity[pond_drop_x][(pond_drop_y + 1) % NUM_COLUMNS] +=
         pond_drop_impulse*k;
@@ -139,7 +148,7 @@ void next_frame(int f) {
     pond_position[NUM_ROWS - 1][j] = 0;
   }
   for (int t = 0; t < POND_TICKS_PER_FRAME; t++) {
-    pond_tick(POND_TIME_SPEEDUP * 1.0/FPS/POND_TICKS_PER_FRAME);
+    pond_tick(POND_TIME_SPEEDUP * dt/POND_TICKS_PER_FRAME);
   }
   for (int i = 0; i < NUM_ROWS; i++) {
     for (int j = 0; j < NUM_COLUMNS; j++) {
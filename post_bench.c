@@ -0,0 +1,142 @@
+// Checks the post_process kernels against the float code that master.c
+// used to run at the end of every frame, and times them and the output
+// stage per frame.
+//
+//   gcc -std=c99 -O3 post_bench.c post_process.c -lm -o bin/post_bench
+//   bin/post_bench 2000
+//
+// Each frame gets random pixels, per-row gains between 0 and 20 (the
+// spotlights go well past the point where every channel saturates) and a
+// random desaturation level.  Exits with status 1 if the integer part of
+// any kernel's result is more than 1 away from the float result, or if any
+// kernel differs from the scalar kernel.
+
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "serpent.h"
+#include "post_process.h"
+
+#define FRAME_BYTES (NUM_PIXELS*3)
+
+static byte input[FRAME_BYTES], expected[FRAME_BYTES], output[FRAME_BYTES];
+static uint16_t scalar[3][NUM_PIXELS], planes[3][NUM_PIXELS];
+static float gains[NUM_ROWS];
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+// The loop from the end of next_frame() in master.c, before post_process.
+void float_post_process(byte* rgb, float* brightness, float desat_level) {
+  for (int r = 0; r < NUM_ROWS; r++) {
+    float gain = brightness[r];
+    for (int c = 0; c < NUM_COLUMNS; c++) {
+      byte* p = rgb + pixel_index(r, c)*3;
+      float red = p[0], green = p[1], blue = p[2];
+      float white = 0.3*red + 0.59*green + 0.11*blue;
+      red = white*desat_level + red*(1 - desat_level);
+      green = white*desat_level + green*(1 - desat_level);
+      blue = white*desat_level + blue*(1 - desat_level);
+      float x = gain * (red + (gain > 1 ? gain - 1 : 0));
+      p[0] = x > 255 ? 255 : x;
+      x = gain * (green + (gain > 1 ? gain - 1 : 0));
+      p[1] = x > 255 ? 255 : x;
+      x = gain * (blue + (gain > 1 ? gain - 1 : 0));
+      p[2] = x > 255 ? 255 : x;
+    }
+  }
+}
+
+void random_frame(float* desat) {
+  int i;
+
+  for (i = 0; i < FRAME_BYTES; i++) {
+    input[i] = random() & 0xff;
+  }
+  for (i = 0; i < NUM_ROWS; i++) {
+    // Mostly the usual range, with some spotlit rows.
+    gains[i] = random() % 4 ? (random() % 2001)/1000.0 :
+        (random() % 20001)/1000.0;
+  }
+  *desat = (random() % 128)/127.0;
+}
+
+int main(int argc, char* argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 1000;
+  int kernels[] = {POST_SCALAR, POST_SSE2, POST_AVX2, POST_NEON};
+  int k, f, i, off_by_one, failed = 0;
+  double start, elapsed;
+  float desat;
+
+  // Correctness: compare every kernel with the float code on the same frames.
+  for (k = 0; k < sizeof(kernels)/sizeof(int); k++) {
+    if (!post_process_use(kernels[k])) {
+      continue;
+    }
+    srandom(1);
+    off_by_one = 0;
+    for (f = 0; f < frames; f++) {
+      random_frame(&desat);
+      memcpy(expected, input, FRAME_BYTES);
+      float_post_process(expected, gains, desat);
+      post_process_use(POST_SCALAR);
+      post_process_rows(input, NUM_ROWS, NUM_COLUMNS, gains, desat,
+                        scalar[0], scalar[1], scalar[2]);
+      post_process_use(kernels[k]);
+      post_process_rows(input, NUM_ROWS, NUM_COLUMNS, gains, desat,
+                        planes[0], planes[1], planes[2]);
+      for (i = 0; i < FRAME_BYTES; i++) {
+        int v = planes[i % 3][i/3], s = scalar[i % 3][i/3];
+        if (v != s || abs((v >> 8) - expected[i]) > 1) {
+          fprintf(stderr, "%s: frame %d byte %d is %d, float %d, scalar %d\n",
+                  post_process_kernel_name(kernels[k]), f, i, v >> 8,
+                  expected[i], s >> 8);
+          failed = 1;
+          break;
+        }
+        off_by_one += (v >> 8) != expected[i];
+      }
+    }
+    printf("%-8s %.4f%% of channels off by 1 from float\n",
+           post_process_kernel_name(kernels[k]),
+           off_by_one*100.0/frames/FRAME_BYTES);
+  }
+
+  // Speed: the same frame over and over, so only the pass itself is timed.
+  srandom(1);
+  random_frame(&desat);
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    float_post_process(input, gains, desat);
+  }
+  elapsed = get_time() - start;
+  printf("%-8s %8.2f us/frame\n", "float", elapsed*1e6/frames);
+  for (k = 0; k < sizeof(kernels)/sizeof(int); k++) {
+    if (post_process_use(kernels[k])) {
+      start = get_time();
+      for (f = 0; f < frames; f++) {
+        post_process_rows(input, NUM_ROWS, NUM_COLUMNS, gains, desat,
+                          planes[0], planes[1], planes[2]);
+      }
+      elapsed = get_time() - start;
+      printf("%-8s %8.2f us/frame\n", post_process_kernel_name(kernels[k]),
+             elapsed*1e6/frames);
+    }
+  }
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    for (i = 0; i < NUM_ROWS; i++) {
+      post_process_output(planes[0] + i*NUM_COLUMNS,
+                          planes[1] + i*NUM_COLUMNS, planes[2] + i*NUM_COLUMNS,
+                          NUM_COLUMNS, i % 2, output + i*NUM_COLUMNS*3);
+    }
+  }
+  elapsed = get_time() - start;
+  printf("%-8s %8.2f us/frame\n", "output", elapsed*1e6/frames);
+  return failed;
+}
@@ -0,0 +1,318 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "post_process.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define POST_X86 1
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define POST_ARM_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* The coefficients are in 16.16 fixed point: for each channel c of a pixel, */
+/*   s = white[0]*r + white[1]*g + white[2]*b + bias */
+/*   out = min(POST_MAX, (k*c + s) >> 8) */
+/* The grey and lift terms are the same for all three channels, so they */
+/* are summed once per pixel.  With the gain held to 32, no sum reaches */
+/* 2^31, so the vector kernels can work in 32-bit lanes. */
+typedef struct {
+  uint32_t k;         /* weight of the channel itself */
+  uint32_t white[3];  /* weights of r, g and b in the grey */
+  uint32_t bias;      /* the gain*(gain - 1) lift */
+} row_coeffs;
+
+typedef void row_func(const uint8_t* p, int n, const row_coeffs* rc,
+                      uint16_t* r, uint16_t* g, uint16_t* b);
+
+/* The output table is indexed by a processed channel without its low */
+/* four bits. */
+#define LUT_SHIFT 4
+#define LUT_SIZE ((POST_MAX >> LUT_SHIFT) + 1)
+
+static row_func* process_row = NULL;
+static int kernel = POST_SCALAR;
+static uint8_t lut[3][LUT_SIZE];
+static int lut_ready = 0;
+
+static void row_coeffs_for(float gain, float desat, row_coeffs* rc) {
+  /* From a gain of 17 up, the lift alone saturates every channel. */
+  float g = gain < 0 ? 0 : gain > 32 ? 32 : gain;
+  float lift = g > 1 ? g - 1 : 0;
+
+  rc->k = g*(1 - desat)*65536 + 0.5;
+  rc->white[0] = g*desat*0.3*65536 + 0.5;
+  rc->white[1] = g*desat*0.59*65536 + 0.5;
+  rc->white[2] = g*desat*0.11*65536 + 0.5;
+  rc->bias = g*lift*65536 + 0.5;
+}
+
+static void scalar_row(const uint8_t* p, int n, const row_coeffs* rc,
+                       uint16_t* r, uint16_t* g, uint16_t* b) {
+  uint32_t s, v;
+
+  for (; n > 0; n--, p += 3) {
+    s = rc->white[0]*p[0] + rc->white[1]*p[1] + rc->white[2]*p[2] + rc->bias;
+    v = (rc->k*p[0] + s) >> 8;
+    *r++ = v > POST_MAX ? POST_MAX : v;
+    v = (rc->k*p[1] + s) >> 8;
+    *g++ = v > POST_MAX ? POST_MAX : v;
+    v = (rc->k*p[2] + s) >> 8;
+    *b++ = v > POST_MAX ? POST_MAX : v;
+  }
+}
+
+#ifdef POST_X86
+
+/* The x86 kernels load each pixel as a 32-bit word whose top byte is the */
+/* next pixel's red, so they stop one pixel short of the end of a row. */
+static uint32_t load32(const uint8_t* p) {
+  uint32_t v;
+  memcpy(&v, p, 4);
+  return v;
+}
+
+/* Multiplies 32-bit lanes by a constant; SSE2 has no _mm_mullo_epi32. */
+__attribute__((target("sse2")))
+static __m128i mul_sse2(__m128i a, __m128i constant) {
+  __m128i even = _mm_mul_epu32(a, constant);
+  __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), constant);
+  return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                            _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+/* Clamps 32-bit lanes at POST_MAX and packs them into the low four 16-bit */
+/* lanes; SSE2 has no unsigned 32-to-16 pack, so this goes through signed. */
+__attribute__((target("sse2")))
+static __m128i pack_sse2(__m128i x) {
+  __m128i limit = _mm_set1_epi32(POST_MAX);
+  __m128i over = _mm_cmpgt_epi32(x, limit);
+  x = _mm_or_si128(_mm_and_si128(over, limit), _mm_andnot_si128(over, x));
+  x = _mm_sub_epi32(x, _mm_set1_epi32(0x8000));
+  return _mm_add_epi16(_mm_packs_epi32(x, x), _mm_set1_epi16(-0x8000));
+}
+
+__attribute__((target("sse2")))
+static void sse2_row(const uint8_t* p, int n, const row_coeffs* rc,
+                     uint16_t* r, uint16_t* g, uint16_t* b) {
+  __m128i k = _mm_set1_epi32(rc->k), bias = _mm_set1_epi32(rc->bias);
+  __m128i wr = _mm_set1_epi32(rc->white[0]);
+  __m128i wg = _mm_set1_epi32(rc->white[1]);
+  __m128i wb = _mm_set1_epi32(rc->white[2]);
+  __m128i low_byte = _mm_set1_epi32(0xff);
+  __m128i v, rv, gv, bv, s;
+
+  for (; n > 4; n -= 4, p += 12, r += 4, g += 4, b += 4) {
+    v = _mm_setr_epi32(load32(p), load32(p + 3), load32(p + 6),
+                       load32(p + 9));
+    rv = _mm_and_si128(v, low_byte);
+    gv = _mm_and_si128(_mm_srli_epi32(v, 8), low_byte);
+    bv = _mm_and_si128(_mm_srli_epi32(v, 16), low_byte);
+    s = _mm_add_epi32(_mm_add_epi32(mul_sse2(rv, wr), mul_sse2(gv, wg)),
+                      _mm_add_epi32(mul_sse2(bv, wb), bias));
+    rv = _mm_srli_epi32(_mm_add_epi32(mul_sse2(rv, k), s), 8);
+    gv = _mm_srli_epi32(_mm_add_epi32(mul_sse2(gv, k), s), 8);
+    bv = _mm_srli_epi32(_mm_add_epi32(mul_sse2(bv, k), s), 8);
+    _mm_storel_epi64((__m128i*) r, pack_sse2(rv));
+    _mm_storel_epi64((__m128i*) g, pack_sse2(gv));
+    _mm_storel_epi64((__m128i*) b, pack_sse2(bv));
+  }
+  scalar_row(p, n, rc, r, g, b);
+}
+
+/* Clamps 32-bit lanes at POST_MAX and packs them into 16-bit lanes. */
+__attribute__((target("avx2")))
+static __m128i pack_avx2(__m256i x) {
+  x = _mm256_min_epi32(x, _mm256_set1_epi32(POST_MAX));
+  x = _mm256_permute4x64_epi64(_mm256_packus_epi32(x, x), 0x08);
+  return _mm256_castsi256_si128(x);
+}
+
+__attribute__((target("avx2")))
+static void avx2_row(const uint8_t* p, int n, const row_coeffs* rc,
+                     uint16_t* r, uint16_t* g, uint16_t* b) {
+  __m256i k = _mm256_set1_epi32(rc->k), bias = _mm256_set1_epi32(rc->bias);
+  __m256i wr = _mm256_set1_epi32(rc->white[0]);
+  __m256i wg = _mm256_set1_epi32(rc->white[1]);
+  __m256i wb = _mm256_set1_epi32(rc->white[2]);
+  __m256i low_byte = _mm256_set1_epi32(0xff);
+  __m256i offsets = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+  __m256i v, rv, gv, bv, s;
+
+  for (; n > 8; n -= 8, p += 24, r += 8, g += 8, b += 8) {
+    v = _mm256_i32gather_epi32((const int*) p, offsets, 1);
+    rv = _mm256_and_si256(v, low_byte);
+    gv = _mm256_and_si256(_mm256_srli_epi32(v, 8), low_byte);
+    bv = _mm256_and_si256(_mm256_srli_epi32(v, 16), low_byte);
+    s = _mm256_add_epi32(
+        _mm256_add_epi32(_mm256_mullo_epi32(rv, wr),
+                         _mm256_mullo_epi32(gv, wg)),
+        _mm256_add_epi32(_mm256_mullo_epi32(bv, wb), bias));
+    rv = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(rv, k), s), 8);
+    gv = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(gv, k), s), 8);
+    bv = _mm256_srli_epi32(_mm256_add_epi32(_mm256_mullo_epi32(bv, k), s), 8);
+    _mm_storeu_si128((__m128i*) r, pack_avx2(rv));
+    _mm_storeu_si128((__m128i*) g, pack_avx2(gv));
+    _mm_storeu_si128((__m128i*) b, pack_avx2(bv));
+  }
+  scalar_row(p, n, rc, r, g, b);
+}
+
+#endif  /* POST_X86 */
+
+#ifdef POST_ARM_NEON
+
+/* Works out four channel values from four pixels' channel and grey sums. */
+static uint16x4_t neon_channel(uint16x4_t c, uint32x4_t s, uint32_t k) {
+  uint32x4_t v = vshrq_n_u32(vmlaq_n_u32(s, vmovl_u16(c), k), 8);
+  return vmovn_u32(vminq_u32(v, vdupq_n_u32(POST_MAX)));
+}
+
+static uint32x4_t neon_grey(uint16x4_t r, uint16x4_t g, uint16x4_t b,
+                            const row_coeffs* rc) {
+  uint32x4_t s = vdupq_n_u32(rc->bias);
+  s = vmlaq_n_u32(s, vmovl_u16(r), rc->white[0]);
+  s = vmlaq_n_u32(s, vmovl_u16(g), rc->white[1]);
+  return vmlaq_n_u32(s, vmovl_u16(b), rc->white[2]);
+}
+
+static void neon_row(const uint8_t* p, int n, const row_coeffs* rc,
+                     uint16_t* r, uint16_t* g, uint16_t* b) {
+  uint16_t* out[3];
+  uint8x8x3_t v;
+  uint16x8_t x[3];
+  uint32x4_t s_low, s_high;
+  int c;
+
+  for (; n >= 8; n -= 8, p += 24, r += 8, g += 8, b += 8) {
+    v = vld3_u8(p);
+    for (c = 0; c < 3; c++) {
+      x[c] = vmovl_u8(v.val[c]);
+    }
+    s_low = neon_grey(vget_low_u16(x[0]), vget_low_u16(x[1]),
+                      vget_low_u16(x[2]), rc);
+    s_high = neon_grey(vget_high_u16(x[0]), vget_high_u16(x[1]),
+                       vget_high_u16(x[2]), rc);
+    out[0] = r;
+    out[1] = g;
+    out[2] = b;
+    for (c = 0; c < 3; c++) {
+      vst1q_u16(out[c], vcombine_u16(
+          neon_channel(vget_low_u16(x[c]), s_low, rc->k),
+          neon_channel(vget_high_u16(x[c]), s_high, rc->k)));
+    }
+  }
+  scalar_row(p, n, rc, r, g, b);
+}
+
+#endif  /* POST_ARM_NEON */
+
+int post_process_use(int new_kernel) {
+  switch (new_kernel) {
+    case POST_SCALAR:
+      process_row = scalar_row;
+      break;
+#ifdef POST_X86
+    case POST_SSE2:
+      if (!__builtin_cpu_supports("sse2")) {
+        return 0;
+      }
+      process_row = sse2_row;
+      break;
+    case POST_AVX2:
+      if (!__builtin_cpu_supports("avx2")) {
+        return 0;
+      }
+      process_row = avx2_row;
+      break;
+#endif
+#ifdef POST_ARM_NEON
+    case POST_NEON:
+      process_row = neon_row;
+      break;
+#endif
+    default:
+      return 0;
+  }
+  kernel = new_kernel;
+  return 1;
+}
+
+int post_process_kernel() {
+  if (!process_row && !post_process_use(POST_AVX2) &&
+      !post_process_use(POST_SSE2) && !post_process_use(POST_NEON)) {
+    post_process_use(POST_SCALAR);
+  }
+  return kernel;
+}
+
+const char* post_process_kernel_name(int kernel) {
+  static const char* names[] = {"scalar", "sse2", "avx2", "neon"};
+  return kernel >= 0 && kernel <= POST_NEON ? names[kernel] : "unknown";
+}
+
+void post_process_rows(const uint8_t* rgb, int rows, int columns,
+                       const float* gains, float desat,
+                       uint16_t* r, uint16_t* g, uint16_t* b) {
+  row_coeffs rc;
+  int row, offset;
+
+  post_process_kernel();
+  for (row = 0; row < rows; row++) {
+    offset = row*columns;
+    row_coeffs_for(gains[row], desat, &rc);
+    process_row(rgb + offset*3, columns, &rc, r + offset, g + offset,
+                b + offset);
+  }
+}
+
+/* Entry i covers processed values i << LUT_SHIFT and the 15 above it, */
+/* and is the 8-bit output for the bottom of that range: 255*white*x^gamma */
+/* with x = i/(LUT_SIZE - 1), so the first entry is for 0 and the last for */
+/* POST_MAX.  At the defaults this drops the fraction, as the header says. */
+static void build_lut() {
+  double gamma = 1, white[3] = {1, 1, 1}, x, v;
+  char* value;
+  int c, i;
+
+  value = getenv("SERPENT_GAMMA");
+  if (value && atof(value) > 0) {
+    gamma = atof(value);
+  }
+  value = getenv("SERPENT_WHITE");
+  if (value && sscanf(value, "%lf,%lf,%lf",
+                      &white[0], &white[1], &white[2]) != 3) {
+    fprintf(stderr, "SERPENT_WHITE should be three gains, like 1,0.8,0.7\n");
+    white[0] = white[1] = white[2] = 1;
+  }
+  for (c = 0; c < 3; c++) {
+    for (i = 0; i < LUT_SIZE; i++) {
+      x = (double) i/(LUT_SIZE - 1);
+      /* The tiny offset keeps x = k/255 from flooring to k - 1. */
+      v = 255*white[c]*pow(x, gamma) + 1e-9;
+      lut[c][i] = v < 0 ? 0 : v > 255 ? 255 : v;
+    }
+  }
+  lut_ready = 1;
+}
+
+void post_process_output(const uint16_t* r, const uint16_t* g,
+                         const uint16_t* b, int n, int reverse, uint8_t* rgb) {
+  int step = 3;
+
+  if (!lut_ready) {
+    build_lut();
+  }
+  if (reverse) {
+    rgb += (n - 1)*3;
+    step = -3;
+  }
+  for (; n > 0; n--, rgb += step) {
+    rgb[0] = lut[0][*r++ >> LUT_SHIFT];
+    rgb[1] = lut[1][*g++ >> LUT_SHIFT];
+    rgb[2] = lut[2][*b++ >> LUT_SHIFT];
+  }
+}
@@ -0,0 +1,44 @@
+// The last passes over every frame: desaturation and per-row brightness,
+// done in fixed point on whole rows of pixels at a time, and then a single
+// conversion back to 8-bit pixels through a gamma and white balance table.
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include <stdint.h>
+
+/* The kernels that post_process_rows() can run on. */
+#define POST_SCALAR 0
+#define POST_SSE2 1
+#define POST_AVX2 2
+#define POST_NEON 3
+
+/* Processed channels are in 8.8 fixed point, from 0 to POST_MAX. */
+#define POST_MAX (255*256)
+
+/* For each of 'rows' rows of 'columns' RGB pixels, mixes each pixel with */
+/* its own grey by 'desat' (0 to 1), then applies the row's gain the way */
+/* master.c always has: c = gain*(c + max(gain - 1, 0)), clamped at 255. */
+/* The results go to the planes r, g and b in 8.8 fixed point; their */
+/* integer parts are within 1 of the float calculation, and the same */
+/* whichever kernel runs them. */
+void post_process_rows(const uint8_t* rgb, int rows, int columns,
+                       const float* gains, float desat,
+                       uint16_t* r, uint16_t* g, uint16_t* b);
+
+/* Selects a kernel; returns 0 if this build or CPU cannot run it.  Until */
+/* this is called, the fastest one available is used. */
+int post_process_use(int kernel);
+
+/* Returns the kernel in use, and its name. */
+int post_process_kernel();
+const char* post_process_kernel_name(int kernel);
+
+/* Converts n processed pixels to RGB bytes through the output table, */
+/* writing them in reverse order if 'reverse' is set.  The table applies */
+/* SERPENT_GAMMA (an exponent, default 1) and SERPENT_WHITE ("r,g,b" */
+/* gains, default "1,1,1") from the environment; by default it just drops */
+/* the fraction. */
+void post_process_output(const uint16_t* r, const uint16_t* g,
+                         const uint16_t* b, int n, int reverse, uint8_t* rgb);
+
+#endif  /* POST_PROCESS_H */
@@ -28,7 +28,7 @@
 #define BUTTON_FORCE 10
 
 #define TICKS_PER_FRAME 10 
-#define FPS 20
+#define TIME_SPEEDUP 1.5  // tuned as 1/20 s per frame at 30 frames/s
 #define MASS 0.1  // kg
 #define FRICTION_FORCE 0.2  // kg*rev^2/s
 #define FRICTION_MIN_VELOCITY 0.01  // rev/s
@@ -68,8 +68,12 @@ void tick(float dt) {
 
 static int clock_delay = 0;
 
-void next_frame(int x) {
-  if (x == 0) {
+void next_frame(int frame) {
+  static float ticks = 0;  // time since frame 0, in units of 1/FPS second
+  float dt = get_frame_seconds();
+
+  ticks = frame == 0 ? 0 : ticks + dt*FPS;
+  if (frame == 0) {
     for (int j = 0; j < 4; j++) {
       for (int i = 0; i < NUM_ROWS; i++) {
         position[j][i] = 0;
@@ -78,7 +82,7 @@ void next_frame(int x) {
     }
   }
 
-  float current_hue = sin(x * 0.01)*0.05 + 0.05;
+  float current_hue = sin(ticks * 0.01)*0.05 + 0.05;
   int r = 0, g = 0, b = 0;
   int k = (current_hue - floor(current_hue)) * 255 * 3;
   if (k < 255) {
@@ -98,7 +102,7 @@ void next_frame(int x) {
   impulse[3] = (read_button('y') - read_button('x'))*50;
 
   for (int t = 0; t < TICKS_PER_FRAME; t++) {
-    tick(1.0/FPS/TICKS_PER_FRAME);
+    tick(TIME_SPEEDUP*dt/TICKS_PER_FRAME);
   }
 
   for (int i = 0; i < NUM_ROWS; i++) {
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "frame_clock.h"
+#include "recorder.h"
+
+static FILE* recorder_file = NULL;
+static u64 recorder_offset = 0;
+static u64 recorder_start_us = 0;
+
+/* The frame being collected: its messages, and which addresses it has. */
+static recording_frame frame;
+static u8* frame_data = NULL;
+static u32 frame_capacity = 0;
+static u8 frame_addresses[256];
+
+/* File offsets of all the frames written so far. */
+static u64* index_offsets = NULL;
+static u64 index_length = 0;
+static u64 index_capacity = 0;
+
+/* Frame times come from the monotonic clock, so that setting the system */
+/* clock during a recording does not throw the replay off. */
+static u64 recorder_now_us() {
+  return frame_clock_now_ns() / 1000;
+}
+
+static void recorder_write(void* data, u32 length) {
+  if (fwrite(data, 1, length, recorder_file) < length) {
+    perror("Recorder: Write failed");
+  }
+  recorder_offset += length;
+}
+
+int recorder_open(char* filename) {
+  recording_header header;
+
+  recorder_file = fopen(filename, "wb");
+  if (!recorder_file) {
+    fprintf(stderr, "Recorder: Could not open %s: ", filename);
+    perror(NULL);
+    return 0;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, RECORDING_MAGIC, 8);
+  recorder_offset = 0;
+  recorder_write(&header, sizeof(header));
+  recorder_start_us = 0;
+  frame.length = 0;
+  frame.num_messages = 0;
+  index_length = 0;
+  memset(frame_addresses, 0, sizeof(frame_addresses));
+  return 1;
+}
+
+void recorder_put_pixels(u8 address, u16 count, u8* rgb) {
+  u32 length = count*3;
+  u32 capacity;
+  u8* d;
+
+  if (!recorder_file) {
+    return;
+  }
+  if (frame_addresses[address]) {
+    recorder_end_frame();
+  }
+  if (frame.num_messages == 0) {
+    frame.time_us = recorder_now_us();
+    if (!recorder_start_us) {
+      recorder_start_us = frame.time_us;
+    }
+    frame.time_us -= recorder_start_us;
+  }
+
+  capacity = frame_capacity ? frame_capacity : 4096;
+  while (capacity < frame.length + 4 + length) {
+    capacity *= 2;
+  }
+  if (capacity > frame_capacity) {
+    d = realloc(frame_data, capacity);
+    if (!d) {
+      fprintf(stderr, "Recorder: Out of memory for a %d-byte frame\n",
+              capacity);
+      return;
+    }
+    frame_data = d;
+    frame_capacity = capacity;
+  }
+  d = frame_data + frame.length;
+  d[0] = address;
+  d[1] = OPC_SET_PIXELS;
+  d[2] = length >> 8;
+  d[3] = length & 0xff;
+  memcpy(d + 4, rgb, length);
+  frame.length += 4 + length;
+  frame.num_messages++;
+  frame_addresses[address] = 1;
+}
+
+void recorder_end_frame() {
+  static u8 padding[8];
+  u64* offsets;
+  u64 capacity;
+
+  if (!recorder_file || frame.num_messages == 0) {
+    return;
+  }
+  if (index_length >= index_capacity) {
+    capacity = index_capacity ? index_capacity*2 : 1024;
+    offsets = realloc(index_offsets, capacity*sizeof(u64));
+    if (!offsets) {
+      fprintf(stderr, "Recorder: Out of memory for index\n");
+      return;
+    }
+    index_offsets = offsets;
+    index_capacity = capacity;
+  }
+  index_offsets[index_length++] = recorder_offset;
+  recorder_write(&frame, sizeof(frame));
+  recorder_write(frame_data, frame.length);
+  recorder_write(padding, -frame.length & 7);
+
+  frame.length = 0;
+  frame.num_messages = 0;
+  memset(frame_addresses, 0, sizeof(frame_addresses));
+}
+
+void recorder_close() {
+  recording_trailer trailer;
+
+  if (!recorder_file) {
+    return;
+  }
+  recorder_end_frame();
+  trailer.num_frames = index_length;
+  trailer.index_offset = recorder_offset;
+  memcpy(trailer.magic, RECORDING_INDEX_MAGIC, 8);
+  recorder_write(index_offsets, index_length*sizeof(u64));
+  recorder_write(&trailer, sizeof(trailer));
+  fclose(recorder_file);
+  recorder_file = NULL;
+}
@@ -0,0 +1,56 @@
+// Recording of pixel frames to a file, for replay with opc_replay.
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include "opc.h"
+
+#ifndef TYPEDEF_U64
+#define TYPEDEF_U64
+typedef uint64_t u64;
+#endif
+
+/* A recording is a header, then frames, then an index, and is only ever */
+/* appended to.  Every part is a multiple of 8 bytes long, so the whole */
+/* file can be mapped into memory and used in place: */
+/*   header:  recording_header */
+/*   frame:   recording_frame, then 'length' bytes of OPC_SET_PIXELS */
+/*            messages (big-endian lengths, as on the wire), zero-padded */
+/*            to a multiple of 8 bytes */
+/*   index:   a u64 file offset for each frame, then recording_trailer */
+/* Other fields are in host byte order.  The index is written by */
+/* recorder_close; a recording without one (say, after a crash) can still */
+/* be read by walking the frames from the start. */
+#define RECORDING_MAGIC "SERPREC1"
+#define RECORDING_INDEX_MAGIC "SERPIDX1"
+
+typedef struct {
+  char magic[8];
+  u64 reserved;
+} recording_header;
+
+typedef struct {
+  u64 time_us;  /* since the first frame */
+  u32 length;
+  u32 num_messages;
+} recording_frame;
+
+typedef struct {
+  u64 num_frames;
+  u64 index_offset;
+  char magic[8];
+} recording_trailer;
+
+/* Starts recording to a new file.  Returns 0 on failure. */
+int recorder_open(char* filename);
+
+/* Records one message.  A message for an address that already has one in */
+/* the current frame starts a new frame. */
+void recorder_put_pixels(u8 address, u16 count, u8* rgb);
+
+/* Ends the current frame, if it has any messages. */
+void recorder_end_frame();
+
+/* Ends the current frame, writes the index, and closes the file. */
+void recorder_close();
+
+#endif  /* RECORDER_H */
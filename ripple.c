@@ -15,10 +15,13 @@
 // limitations under the License.
 
 #include <stdlib.h>
+#include <strings.h>
 #include "serpent.h"
+#include "blend.h"
 
 #define RIPPLES 10
 
+static pixel rings[NUM_PIXELS];  // row by row, not in wiring order
 static unsigned char pixels[9000];
 
 void next_frame(int frame) {
@@ -32,10 +35,8 @@ void next_frame(int frame) {
   static int nnext=0;
   static int nmax=0;
   int i,j,k;
-  int distance;
   int rmin;
   int rmax;
-  int pixnum;
 
   if(frame%22==0) {
     red[nnext]=rand()%100+56;
@@ -61,9 +62,7 @@ void next_frame(int frame) {
 
   }
 
-  for(j=0;i<9000;i++) {
-    pixels[i]=0;
-  }
+  bzero(rings, sizeof(rings));
 
   for(k=0;k<nmax;k++) {
     if(radius[k]/6==0) {
@@ -77,36 +76,15 @@ void next_frame(int frame) {
       rmax*=rmax;
     }
 
-    for(j=0;j<125;j++) {
-      for(i=0;i<120;i++) {
-        distance = (posx[k]-i)*(posx[k]-i)+(posy[k]-j)*(posy[k]-j);
-        if(distance>=rmin && distance<=rmax) {
-          pixnum = pixel_index(i,j%25)*3;
-          if(255-pixels[pixnum]<red[k]) {
-           pixels[pixnum]=255;
-          }
-          else {
-            pixels[pixnum]+=red[k];
-          }
-          pixnum++;
-
-          if(255-pixels[pixnum]<green[k]) {
-           pixels[pixnum]=255;
-          }
-          else {
-            pixels[pixnum]+=green[k];
-          }
-          pixnum++;
-
-
-          if(255-pixels[pixnum]<blue[k]) {
-           pixels[pixnum]=255;
-          }
-          else {
-            pixels[pixnum]+=blue[k];
-          }
-        }
-      }
+    pixel colour = {red[k], green[k], blue[k]};
+    add_ring(rings, NUM_ROWS, NUM_COLUMNS, 5*NUM_COLUMNS, posx[k], posy[k],
+             rmin, rmax, colour);
+  }
+
+  for(i=0;i<NUM_ROWS;i++) {
+    for(j=0;j<NUM_COLUMNS;j++) {
+      pixel c = rings[i*NUM_COLUMNS+j];
+      set_rgb_rc(pixels, i, j, c.r, c.g, c.b);
     }
   }
 
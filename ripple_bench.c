@@ -0,0 +1,116 @@
+// Checks add_ring() against the full-grid distance scan that the ripple
+// pattern used to run for every ring, then times both per frame with 10
+// and with 100 rings.
+//
+//   gcc -std=c99 -O3 ripple_bench.c blend.c -lm -o bin/ripple_bench
+//   bin/ripple_bench 2000
+//
+// The rings are placed and sized the way ripple places them, with radii
+// up to 320.  Exits with status 1 if add_ring() paints any frame
+// differently from the scan.
+
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "serpent.h"
+#include "blend.h"
+
+#define MAX_RINGS 100
+#define RING_COLUMNS (5*NUM_COLUMNS)
+
+static int posx[MAX_RINGS], posy[MAX_RINGS], rmin[MAX_RINGS], rmax[MAX_RINGS];
+static pixel colours[MAX_RINGS];
+static pixel scanned[NUM_PIXELS], rasterized[NUM_PIXELS];
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+void random_rings(int count) {
+  int k, radius;
+
+  for (k = 0; k < count; k++) {
+    radius = random() % 321;
+    posx[k] = random() % NUM_ROWS;
+    posy[k] = random() % NUM_COLUMNS + 2*NUM_COLUMNS;
+    rmin[k] = radius/6 ? (radius - radius/6)*(radius - radius/6) : 0;
+    rmax[k] = (radius + radius/6)*(radius + radius/6);
+    colours[k].r = random() % 100 + 26;
+    colours[k].g = random() % 100 + 26;
+    colours[k].b = random() % 100 + 26;
+  }
+}
+
+// The loop from ripple_next_frame() in master.c, before add_ring().
+void scan_rings(pixel* grid, int count) {
+  int i, j, k, distance, v;
+  pixel* p;
+
+  memset(grid, 0, sizeof(pixel)*NUM_PIXELS);
+  for (k = 0; k < count; k++) {
+    for (j = 0; j < RING_COLUMNS; j++) {
+      for (i = 0; i < NUM_ROWS; i++) {
+        distance = (posx[k] - i)*(posx[k] - i) + (posy[k] - j)*(posy[k] - j);
+        if (distance >= rmin[k] && distance <= rmax[k]) {
+          p = &grid[i*NUM_COLUMNS + j % NUM_COLUMNS];
+          v = p->r + colours[k].r;
+          p->r = v > 255 ? 255 : v;
+          v = p->g + colours[k].g;
+          p->g = v > 255 ? 255 : v;
+          v = p->b + colours[k].b;
+          p->b = v > 255 ? 255 : v;
+        }
+      }
+    }
+  }
+}
+
+void rasterize_rings(pixel* grid, int count) {
+  int k;
+
+  memset(grid, 0, sizeof(pixel)*NUM_PIXELS);
+  for (k = 0; k < count; k++) {
+    add_ring(grid, NUM_ROWS, NUM_COLUMNS, RING_COLUMNS, posx[k], posy[k],
+             rmin[k], rmax[k], colours[k]);
+  }
+}
+
+int main(int argc, char* argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 1000;
+  int counts[] = {10, 100};
+  int c, f, failed = 0;
+  double start, scan_time, raster_time;
+
+  for (f = 0; f < frames; f++) {
+    random_rings(MAX_RINGS);
+    scan_rings(scanned, MAX_RINGS);
+    rasterize_rings(rasterized, MAX_RINGS);
+    if (memcmp(scanned, rasterized, sizeof(scanned))) {
+      fprintf(stderr, "add_ring differs on frame %d\n", f);
+      failed = 1;
+      break;
+    }
+  }
+
+  for (c = 0; c < sizeof(counts)/sizeof(int); c++) {
+    srandom(1);
+    random_rings(counts[c]);
+    start = get_time();
+    for (f = 0; f < frames; f++) {
+      scan_rings(scanned, counts[c]);
+    }
+    scan_time = (get_time() - start)/frames;
+    start = get_time();
+    for (f = 0; f < frames; f++) {
+      rasterize_rings(rasterized, counts[c]);
+    }
+    raster_time = (get_time() - start)/frames;
+    printf("%3d rings: scan %8.2f us/frame, add_ring %8.2f us/frame (%.1fx)\n",
+           counts[c], scan_time*1e6, raster_time*1e6, scan_time/raster_time);
+  }
+  return failed;
+}
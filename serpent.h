@@ -17,7 +17,10 @@
 #define M_PI 3.1415926535897932384626433832795
 #endif
 
+// Patterns are tuned to this frame rate, and backends run at it unless the
+// SERPENT_FPS environment variable asks for another (up to MAX_FPS).
 #define FPS 30
+#define MAX_FPS 240
 
 #define HEAD_PIXELS 600 // number of pixels in the serpent's head
 
@@ -88,8 +91,15 @@ void put_segment_pixels(int segment, byte* pixels, int n);
 void put_fin_pixels(byte* pixels, int n);
 void put_spine_pixels(byte* pixels, int n);
 void next_frame(int frame);
+float get_frame_seconds();  // time covered by the frame being rendered
 int read_button(char b);  // 'a', 'b', 'x', or 'y'
 const char* get_button_sequence();
 void clear_button_sequence();
 int accel_right();
 int accel_forward();
+
+// Implemented by master.c, for serpent_bench.
+int get_num_patterns();
+const char* get_pattern_name(int i);
+void select_pattern(int i);
+void seed_random(unsigned int seed);
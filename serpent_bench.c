@@ -0,0 +1,173 @@
+/* Serpent main routine for benchmarking: no output, no frame pacing. */
+
+// Runs each pattern in master.c for a fixed number of frames, as fast as it
+// will go, and prints the time per frame as CSV on stdout:
+//
+//   pattern,frames,mean_ns,p50_ns,p99_ns,max_ns,pixels_per_sec
+//
+// Usage: serpent_bench [-n frames] [-f fps] [-t threads] [-s seed]
+//                      [-c control=value]... [-b buttons] [pattern]...
+//
+// Patterns animate as if running at -f frames per second (FPS by default),
+// however long the frames really take.  -t sets how many threads render
+// the parallel_capable patterns (see parallel.h); run it with -t 1, 2, 4...
+// to see how they scale.
+// -c holds a MIDI control at a value for the whole run, and -b holds down
+// any of the buttons a, b, x and y.  With no pattern names, every pattern
+// in PATTERNS[] is run.
+
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "serpent.h"
+#include "frame_clock.h"
+#include "midi.h"
+#include "parallel.h"
+
+#define MAX_CONTROLS 32
+
+static long pixels_put = 0;
+static char* held_buttons = "";
+static int num_controls = 0;
+static byte controls[MAX_CONTROLS], control_values[MAX_CONTROLS];
+static FILE* results;
+static float frame_seconds = 1.0/FPS;
+
+void put_head_pixels(byte* pixels, int n) {
+  pixels_put += n;
+}
+
+void put_segment_pixels(int segment, byte* pixels, int n) {
+  pixels_put += n;
+}
+
+void put_spine_pixels(byte* pixels, int n) {
+  pixels_put += n;
+}
+
+void put_fin_pixels(byte* pixels, int n) {
+  pixels_put += n;
+}
+
+float get_frame_seconds() {
+  return frame_seconds;
+}
+
+int read_button(char b) {
+  return b && strchr(held_buttons, b | 0x20) != NULL;
+}
+
+const char* get_button_sequence() {
+  return "";
+}
+
+void clear_button_sequence() {
+}
+
+int accel_right() {
+  return 0;
+}
+
+int accel_forward() {
+  return 0;
+}
+
+int compare_ns(const void* a, const void* b) {
+  int64_t x = *(int64_t*) a, y = *(int64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Runs one pattern for 'frames' frames, starting at frame number 'start'.
+void bench_pattern(int p, int start, int frames, int64_t* ns) {
+  int64_t total = 0, begin;
+  int f, c;
+
+  pixels_put = 0;
+  select_pattern(p);
+  for (f = 0; f < frames; f++) {
+    // Patterns reset some controls when they start, so apply these each time.
+    for (c = 0; c < num_controls; c++) {
+      midi_set_control(controls[c], control_values[c]);
+    }
+    begin = frame_clock_now_ns();
+    next_frame(start + f);
+    ns[f] = frame_clock_now_ns() - begin;
+    total += ns[f];
+  }
+  qsort(ns, frames, sizeof(int64_t), compare_ns);
+  fprintf(results, "%s,%d,%lld,%lld,%lld,%lld,%.0f\n",
+          get_pattern_name(p), frames, (long long) (total/frames),
+          (long long) ns[frames/2], (long long) ns[(frames*99)/100],
+          (long long) ns[frames - 1], pixels_put*1e9/total);
+}
+
+int main(int argc, char* argv[]) {
+  int frames = 1000, frame = 0;
+  unsigned int seed = 1;
+  int opt, p, a, found;
+  int64_t* ns;
+  char* value;
+
+  while ((opt = getopt(argc, argv, "n:f:t:s:c:b:")) != -1) {
+    switch (opt) {
+      case 'n':
+        frames = atoi(optarg);
+        break;
+      case 'f':
+        frame_seconds = 1.0/clamp(atoi(optarg), 1, MAX_FPS);
+        break;
+      case 't':
+        parallel_set_threads(atoi(optarg));
+        break;
+      case 's':
+        seed = atoi(optarg);
+        break;
+      case 'c':
+        value = strchr(optarg, '=');
+        if (!value || num_controls >= MAX_CONTROLS) {
+          fprintf(stderr, "Bad control setting: %s\n", optarg);
+          return 1;
+        }
+        controls[num_controls] = atoi(optarg);
+        control_values[num_controls++] = atoi(value + 1);
+        break;
+      case 'b':
+        held_buttons = optarg;
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n frames] [-f fps] [-t threads] "
+                "[-s seed] [-c control=value]... [-b buttons] [pattern]...\n",
+                argv[0]);
+        return 1;
+    }
+  }
+  if (frames < 1) {
+    frames = 1;
+  }
+  ns = malloc(frames*sizeof(int64_t));
+
+  // Pattern messages go to stderr, so stdout has only the results.
+  results = fdopen(dup(1), "w");
+  dup2(2, 1);
+
+  midi_init();
+  seed_random(seed);
+  next_frame(frame++);  // sets up the tables and the master controls
+
+  fprintf(results,
+          "pattern,frames,mean_ns,p50_ns,p99_ns,max_ns,pixels_per_sec\n");
+  for (p = 0; p < get_num_patterns(); p++) {
+    found = optind >= argc;
+    for (a = optind; a < argc; a++) {
+      found |= !strcmp(argv[a], get_pattern_name(p));
+    }
+    if (found) {
+      seed_random(seed);
+      bench_pattern(p, frame, frames, ns);
+      frame += frames;
+    }
+  }
+  return 0;
+}
@@ -13,6 +13,15 @@
 #include <sys/timeb.h>
 #include "total_control.h"
 #include "serpent.h"
+#include "frame_clock.h"
+#include "stage_stats.h"
+
+static int fps = FPS;
+static float frame_seconds = 1.0/FPS;
+
+float get_frame_seconds() {
+  return frame_seconds;
+}
 
 static byte head[(1 + HEAD_PIXELS)*3];
 static byte segments[NUM_SEGS][(1 + SEG_PIXELS)*3];
@@ -181,9 +190,9 @@ void* connect_to_accelerometer(char* path) {
 float accel_x_center = 0;
 float accel_y_center = 0;
 float accel_x = 0, accel_y = 0;
-#define ACCEL_HISTORY (30*FPS)
-int accel_x_history[ACCEL_HISTORY];
-int accel_y_history[ACCEL_HISTORY];
+#define ACCEL_HISTORY_SECONDS 30
+int accel_x_history[ACCEL_HISTORY_SECONDS*MAX_FPS];
+int accel_y_history[ACCEL_HISTORY_SECONDS*MAX_FPS];
 int accel_x_sum = 0;
 int accel_y_sum = 0;
 int accel_sum_count = 0;
@@ -207,7 +216,7 @@ void read_accelerometer(char* filename, int frame) {
     }
     last_timestamp = timestamp;
 
-    if (accel_sum_count == ACCEL_HISTORY) {
+    if (accel_sum_count == ACCEL_HISTORY_SECONDS*fps) {
       accel_x_sum -= accel_x_history[accel_i];
       accel_y_sum -= accel_y_history[accel_i];
       accel_sum_count--;
@@ -217,9 +226,9 @@ void read_accelerometer(char* filename, int frame) {
     accel_sum_count++;
     accel_x_history[accel_i] = x;
     accel_y_history[accel_i] = y;
-    accel_i = (accel_i + 1) % ACCEL_HISTORY;
+    accel_i = (accel_i + 1) % (ACCEL_HISTORY_SECONDS*fps);
 
-    if (frame < 5*FPS) {
+    if (frame < 5*fps) {
       accel_x = 0;
       accel_y = 0;
     } else {
@@ -237,48 +246,63 @@ int accel_forward() {
   return (accel_y > 15 || accel_y < -15) ? -accel_y : 0;
 }
 
+#define STATUS_INTERVAL 10  // frames between status lines
+
 int main(int argc, char* argv[]) {
   int frame = 0;
-  int start_time = get_milliseconds();
-  int next_frame_time = start_time + 1000/FPS;
+  frame_clock frame_timer;
   int now;
   int s, i;
   int clock_delay = 0;
   int time_buffer[11], ti = 0, tf = 0;
   int last_button_count = 0;
+  int pattern_stage, send_stage, frame_stage;
+  int64_t frame_start, stage_start;
 
   bzero(head, (1 + HEAD_PIXELS)*3);
   bzero(segments, NUM_SEGS*(1 + SEG_PIXELS)*3);
   tcl_init();
   tcl_set_clock_delay(clock_delay);
+  stage_stats_init();
+  pattern_stage = stage_stats_add("next_frame");
+  send_stage = stage_stats_add("send");
+  frame_stage = stage_stats_add("frame");
+  fps = frame_clock_rate("SERPENT_FPS", FPS, MAX_FPS);
+  frame_seconds = 1.0/fps;
+  frame_clock_init(&frame_timer, fps, FRAME_CLOCK_SKIP);
   while (1) {
     read_accelerometer("/tmp/.accel", frame);
-    while (now < next_frame_time) {
-      now = get_milliseconds();
-    }
+    frame_seconds = frame_clock_seconds(&frame_timer,
+                                        frame_clock_wait(&frame_timer));
+    frame_start = stage_stats_start();
     longest_sequence = 0;
     next_frame(frame++);
+    stage_stats_end(pattern_stage, frame_start);
+    stage_start = stage_stats_start();
     tcl_put_pixels_multi(strand_ptrs, 1 + NUM_SEGS, longest_sequence + 1);
+    stage_stats_end(send_stage, stage_start);
+    stage_stats_end(frame_stage, frame_start);
+    stage_stats_frame();
 
     now = get_milliseconds();
     tf += (tf < 10);
     ti = (ti + 1) % 11;
     time_buffer[ti] = now;
-    printf("frame %5d (%.1f fps)  %c%c%c%c  [%-10s]  ", frame,
-           tf*1000.0/(now - time_buffer[(ti + 11 - tf) % 11]),
-           read_button('a') ? 'a' : ' ',
-           read_button('b') ? 'b' : ' ',
-           read_button('x') ? 'x' : ' ',
-           read_button('y') ? 'y' : ' ',
-           button_sequence);
-    if (accel_right() || accel_forward()) {
-      printf("forward%+3d right%+3d\n", accel_forward(), accel_right());
-    } else {
-      printf("\r");
+    if (frame % STATUS_INTERVAL == 0) {
+      printf("frame %5d (%.1f fps)  %c%c%c%c  [%-10s]  ", frame,
+             tf*1000.0/(now - time_buffer[(ti + 11 - tf) % 11]),
+             read_button('a') ? 'a' : ' ',
+             read_button('b') ? 'b' : ' ',
+             read_button('x') ? 'x' : ' ',
+             read_button('y') ? 'y' : ' ',
+             button_sequence);
+      if (accel_right() || accel_forward()) {
+        printf("forward%+3d right%+3d\n", accel_forward(), accel_right());
+      } else {
+        printf("\r");
+      }
+      fflush(stdout);
     }
-    fflush(stdout);
-
-    next_frame_time += 1000/FPS;
 
     update_buttons();
     if (last_button_count == 0 && pressed_button_count == 1) {
@@ -26,6 +26,7 @@
 #endif
 
 #include "serpent.h"
+#include "frame_clock.h"
 #include "midi.h"
 
 typedef struct {
@@ -87,7 +88,9 @@ colour render_grids[NUM_SEGS][(SEG_NK + 1)*SEG_NA];
 double blur[BLUR_WIDTH][BLUR_WIDTH];
 
 // Animation parameters
-double next_frame_time;
+frame_clock frame_timer;
+int fps = FPS;
+float frame_seconds = 1.0/FPS;
 int frame = 0, paused = 0;
 
 
@@ -488,6 +491,10 @@ void special_up(int key, int x, int y) {
   }
 }
 
+float get_frame_seconds() {
+  return frame_seconds;
+}
+
 int read_button(char b) {
   switch (b) {
     case 'Y':
@@ -576,27 +583,29 @@ int last_button_count = 0;
 
 void idle(void) {
   if (!paused) {
-    double now = get_time();
-    if (now >= next_frame_time) {
-      midi_poll();
-      next_frame(frame++);
-      update_render_grid();
-      display();
-
-      now = get_time();
-      tf += (tf < 10);
-      ti = (ti + 1) % 11;
-      time_buffer[ti] = now;
-      printf("frame %5d (%4.1f fps)  [%c%c%c%c%c%c%c%c] %02x %02x %02x %02x %02x %02x %02x %02x  \r", frame,
-           tf/(now - time_buffer[(ti + 11 - tf) % 11]),
-           midi_get_note(1) > 0 ? '1' : ' ',
-           midi_get_note(2) > 0 ? '2' : ' ',
-           midi_get_note(3) > 0 ? '3' : ' ',
-           midi_get_note(4) > 0 ? '4' : ' ',
-           midi_get_note(5) > 0 ? '5' : ' ',
-           midi_get_note(6) > 0 ? '6' : ' ',
-           midi_get_note(7) > 0 ? '7' : ' ',
-           midi_get_note(8) > 0 ? '8' : ' ',
+    double now;
+    // Sleep until the frame is due; GLUT handles input between frames.
+    int skipped = frame_clock_wait(&frame_timer);
+    frame_seconds = frame_clock_seconds(&frame_timer, skipped);
+    midi_poll();
+    next_frame(frame++);
+    update_render_grid();
+    display();
+
+    now = get_time();
+    tf += (tf < 10);
+    ti = (ti + 1) % 11;
+    time_buffer[ti] = now;
+    printf("frame %5d (%4.1f fps)  [%c%c%c%c%c%c%c%c] %02x %02x %02x %02x %02x %02x %02x %02x  \r", frame,
+         tf/(now - time_buffer[(ti + 11 - tf) % 11]),
+         midi_get_note(1) > 0 ? '1' : ' ',
+         midi_get_note(2) > 0 ? '2' : ' ',
+         midi_get_note(3) > 0 ? '3' : ' ',
+         midi_get_note(4) > 0 ? '4' : ' ',
+         midi_get_note(5) > 0 ? '5' : ' ',
+         midi_get_note(6) > 0 ? '6' : ' ',
+         midi_get_note(7) > 0 ? '7' : ' ',
+         midi_get_note(8) > 0 ? '8' : ' ',
 	   midi_get_control(1),
 	   midi_get_control(2),
 	   midi_get_control(3),
@@ -605,34 +614,31 @@ void idle(void) {
 	   midi_get_control(6),
 	   midi_get_control(7),
 	   midi_get_control(8));
-      if (accel_right() || accel_forward()) {
-        printf("forward%+3d right%+3d\n", accel_forward(), accel_right());
-      } else {
-        printf("\r");
-      }
-      fflush(stdout);
+    if (accel_right() || accel_forward()) {
+      printf("forward%+3d right%+3d\n", accel_forward(), accel_right());
+    } else {
+      printf("\r");
+    }
+    fflush(stdout);
 
-      if (now > next_frame_time + 1.0) {
-        next_frame_time = now;
-        time_buffer[ti] = now;
-        tf = 0;
-      }
-      next_frame_time += 1.0/FPS;
-
-      update_buttons();
-      if (last_button_count == 0 && pressed_button_count == 1) {
-        if (button_sequence_i < 10) {
-          button_sequence[button_sequence_i++] = button_name[pressed_button];
-          button_sequence[button_sequence_i] = 0;
-          last_button_sequence_time = now;
-        }
-      }
-      last_button_count = pressed_button_count;
-      if (button_name[pressed_button] == 'y' ||
-          now - last_button_sequence_time > 10) {  // cancel
-        clear_button_sequence();
+    if (skipped >= fps) {  // stalled for a second or more
+      time_buffer[ti] = now;
+      tf = 0;
+    }
+
+    update_buttons();
+    if (last_button_count == 0 && pressed_button_count == 1) {
+      if (button_sequence_i < 10) {
+        button_sequence[button_sequence_i++] = button_name[pressed_button];
+        button_sequence[button_sequence_i] = 0;
+        last_button_sequence_time = now;
       }
     }
+    last_button_count = pressed_button_count;
+    if (button_name[pressed_button] == 'y' ||
+        now - last_button_sequence_time > 10) {  // cancel
+      clear_button_sequence();
+    }
   }
 }
 
@@ -677,7 +683,9 @@ void init(void) {
   }
 
   time_buffer[0] = get_time();
-  next_frame_time = time_buffer[0] + 1.0/FPS;
+  fps = frame_clock_rate("SERPENT_FPS", FPS, MAX_FPS);
+  frame_seconds = 1.0/fps;
+  frame_clock_init(&frame_timer, fps, FRAME_CLOCK_SKIP);
 
   midi_init();
 }
@@ -1,6 +1,8 @@
 /* Serpent main routine, for Chumby. */
 
 #define _SVID_SOURCE 1
+#include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <sys/mman.h>
@@ -13,30 +15,27 @@
 #include <sys/timeb.h>
 #include "total_control.h"
 #include "serpent.h"
+#include "frame_clock.h"
 #include "tcp_pixels.h"
+#include "recorder.h"
+#include "stage_stats.h"
 #include "midi.h"
 
 #define JULUNGGUL 0  // white serpent
 #define JORMUNGAND 1  // black serpent
 static byte serpent_mode = JULUNGGUL;
 
-static byte head[HEAD_PIXELS*3];
-static byte segments[NUM_SEGS][(SEG_PIXELS + FIN_PIXELS + LID_PIXELS)*3];
+#define STATUS_INTERVAL 10  // frames sent between status lines
+
+static int fps = FPS;
+static float frame_seconds = 1.0/FPS;
+
+float get_frame_seconds() {
+  return frame_seconds;
+}
+
 static byte spine[NUM_ROWS*3];
 static byte fins[NUM_SEGS*FIN_PIXELS*3];
-static byte* strand_ptrs[1 + NUM_SEGS] = {
-  head,
-  segments[0], // barrel 1
-  segments[1], // barrel 2
-  segments[2], // barrel 3
-  segments[3], // barrel 4
-  segments[4], // barrel 5
-  segments[5], // barrel 6
-  segments[6], // barrel 7
-  segments[7], // barrel 8
-  segments[8], // barrel 9
-  segments[9] // tail
-};
 
 static byte diagnostic_colours[11][3] = {
   {255, 255, 255},  // white for head
@@ -72,7 +71,71 @@ static byte diagnostic_colours[11][3] = {
 #define TAIL_LANTERN_COUNT 22
 #define TAIL_PIXELS TAIL_LANTERN_START + TAIL_LANTERN_COUNT
 
-byte jormungand_segment[JORM_SEG_PIXELS*3];
+#define SEG_BYTES ((SEG_PIXELS + FIN_PIXELS + LID_PIXELS)*3)
+
+// One frame's worth of strands, as sent to the PSoCs.  Frames are rendered
+// into one set while the output thread sends another.  The three sets
+// rotate between the render thread ('back'), a mailbox ('middle', swapped
+// atomically) and the output thread ('front'); if the output thread falls
+// behind, the newest frame in the mailbox replaces the older one.
+typedef struct {
+  byte head[HEAD_PIXELS*3];
+  byte segments[NUM_SEGS][SEG_BYTES];
+  byte jormungand_segments[NUM_SEGS - 1][JORM_SEG_PIXELS*3];
+  byte* strand_ptrs[1 + NUM_SEGS];
+  byte* jormungand_strand_ptrs[1 + NUM_SEGS];
+  byte** send_ptrs;  // whichever of the above two is to be sent
+  int* send_counts;
+  int64_t rendered_ns;  // when the render thread finished with it
+  // What the status line shows, as it was when the frame was posted.
+  int frame;
+  int frames_dropped;
+  byte notes[8];
+  byte controls[8];
+} strand_buffers;
+
+#define FRESH 4  // flag on 'middle': the frame there has not been sent
+
+static strand_buffers buffers[3];
+static int back = 0, middle = 1, front = 2;
+static sem_t output_wakeup;
+static pthread_t output_thread;
+static volatile int output_running = 0;
+static int frames_dropped = 0;
+static int send_stage, latency_stage;
+
+// The render thread's view of buffers[back].
+static byte* head;
+static byte (*segments)[SEG_BYTES];
+static byte (*jormungand_segments)[JORM_SEG_PIXELS*3];
+
+// Number of pixels on each strand, in the same order as the strand pointers
+static int strand_counts[1 + NUM_SEGS] = {
+  HEAD_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS,
+  SEG_PIXELS + FIN_PIXELS + LID_PIXELS
+};
+static int jormungand_strand_counts[1 + NUM_SEGS] = {
+  HEAD_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  JORM_SEG_PIXELS,
+  TAIL_PIXELS
+};
 
 // On Jormungand, the spine pixels within a barrel alternate left and right.
 // On some barrels, the frontmost spine pixel is on the left; on other barrels
@@ -199,6 +262,118 @@ void average_rgb(byte* dest, byte* pixels, int n) {
   dest[2] = (byte) (blue/n);
 }
 
+// Records a frame as it goes to the PSoCs (channel c is address c + 1), if
+// SERPENT_RECORD names a file to record to.
+void record_frame(byte** pixel_ptrs, int* pixel_counts, int num_channels) {
+  int c;
+
+  for (c = 0; c < num_channels; c++) {
+    recorder_put_pixels(c + 1, pixel_counts[c], pixel_ptrs[c]);
+  }
+  recorder_end_frame();
+}
+
+// Points the render thread at the buffers it should draw the next frame in.
+void use_back_buffers() {
+  head = buffers[back].head;
+  segments = buffers[back].segments;
+  jormungand_segments = buffers[back].jormungand_segments;
+}
+
+void init_strand_buffers() {
+  int b, s;
+
+  bzero(buffers, sizeof(buffers));
+  for (b = 0; b < 3; b++) {
+    buffers[b].strand_ptrs[0] = buffers[b].head;
+    buffers[b].jormungand_strand_ptrs[0] = buffers[b].head;
+    for (s = 0; s < NUM_SEGS; s++) {
+      buffers[b].strand_ptrs[1 + s] = buffers[b].segments[s];
+      buffers[b].jormungand_strand_ptrs[1 + s] = s < NUM_SEGS - 1 ?
+          buffers[b].jormungand_segments[s] : buffers[b].segments[s];  // tail
+    }
+  }
+  use_back_buffers();
+}
+
+// Hands the frame in the back buffers to the output thread, and takes a
+// free set of buffers to render the next frame in.
+void post_frame(byte** pixel_ptrs, int* pixel_counts) {
+  static int frame = 0;
+  int slot, i;
+
+  buffers[back].send_ptrs = pixel_ptrs;
+  buffers[back].send_counts = pixel_counts;
+  buffers[back].frame = frame++;
+  buffers[back].frames_dropped = frames_dropped;
+  for (i = 0; i < 8; i++) {
+    buffers[back].notes[i] = midi_get_note(i + 1);
+    buffers[back].controls[i] = midi_get_control(i + 1);
+  }
+  buffers[back].rendered_ns = stage_stats_start();
+  __sync_synchronize();  // frame contents must be visible before the swap
+  slot = __sync_lock_test_and_set(&middle, back | FRESH);
+  back = slot & ~FRESH;
+  if (slot & FRESH) {
+    frames_dropped++;  // the output thread never got to that one
+  } else {
+    sem_post(&output_wakeup);
+  }
+  use_back_buffers();
+}
+
+int get_milliseconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+// Prints the status line for a frame that has just been sent.  This runs
+// on the output thread, so the render thread never waits on the terminal.
+void print_status(strand_buffers* b) {
+  static int last = 0;  // when the last status line was printed
+  int now = get_milliseconds();
+  char notes[9];
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    notes[i] = b->notes[i] > 0 ? '1' + i : ' ';
+  }
+  notes[8] = 0;
+  printf("frame %5d (%4.1f fps, %d dropped)  [%s] %02x %02x %02x %02x %02x %02x %02x %02x  \r", b->frame,
+         last && now > last ? STATUS_INTERVAL*1000.0/(now - last) : 0,
+         b->frames_dropped, notes,
+         b->controls[0], b->controls[1], b->controls[2], b->controls[3],
+         b->controls[4], b->controls[5], b->controls[6], b->controls[7]);
+  fflush(stdout);
+  last = now;
+}
+
+void* output_loop(void* arg) {
+  strand_buffers* b;
+  int64_t start;
+  int sent = 0;
+
+  while (output_running) {
+    sem_wait(&output_wakeup);
+    if (!(middle & FRESH)) {
+      continue;
+    }
+    __sync_synchronize();  // finished with the old front buffers
+    front = __sync_lock_test_and_set(&middle, front) & ~FRESH;
+    b = &buffers[front];
+    start = stage_stats_start();
+    tcp_put_pixels_multi(b->send_ptrs, b->send_counts, 1 + NUM_SEGS);
+    stage_stats_end(send_stage, start);
+    stage_stats_end(latency_stage, b->rendered_ns);
+    record_frame(b->send_ptrs, b->send_counts, 1 + NUM_SEGS);
+    if (++sent % STATUS_INTERVAL == 0) {
+      print_status(b);
+    }
+  }
+  return NULL;
+}
+
 void set_lid_pixels() {
   int s;
   byte* row;
@@ -283,12 +458,6 @@ int read_button(char button) {
   return 0;
 }
 
-int get_milliseconds() {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
-}
-
 typedef struct {
   unsigned int version;
   unsigned int timestamp;
@@ -329,9 +498,9 @@ void* connect_to_accelerometer(char* path) {
 float accel_x_center = 0;
 float accel_y_center = 0;
 float accel_x = 0, accel_y = 0;
-#define ACCEL_HISTORY (30*FPS)
-int accel_x_history[ACCEL_HISTORY];
-int accel_y_history[ACCEL_HISTORY];
+#define ACCEL_HISTORY_SECONDS 30
+int accel_x_history[ACCEL_HISTORY_SECONDS*MAX_FPS];
+int accel_y_history[ACCEL_HISTORY_SECONDS*MAX_FPS];
 int accel_x_sum = 0;
 int accel_y_sum = 0;
 int accel_sum_count = 0;
@@ -355,7 +524,7 @@ void read_accelerometer(char* filename, int frame) {
     }
     last_timestamp = timestamp;
 
-    if (accel_sum_count == ACCEL_HISTORY) {
+    if (accel_sum_count == ACCEL_HISTORY_SECONDS*fps) {
       accel_x_sum -= accel_x_history[accel_i];
       accel_y_sum -= accel_y_history[accel_i];
       accel_sum_count--;
@@ -365,9 +534,9 @@ void read_accelerometer(char* filename, int frame) {
     accel_sum_count++;
     accel_x_history[accel_i] = x;
     accel_y_history[accel_i] = y;
-    accel_i = (accel_i + 1) % ACCEL_HISTORY;
+    accel_i = (accel_i + 1) % (ACCEL_HISTORY_SECONDS*fps);
 
-    if (frame < 5*FPS) {
+    if (frame < 5*fps) {
       accel_x = 0;
       accel_y = 0;
     } else {
@@ -388,19 +557,21 @@ int accel_forward() {
 int main(int argc, char* argv[]) {
   static float fcount = 0;
   int frame = 0;
-  int start_time = get_milliseconds();
-  int next_frame_time = start_time + 1000/FPS;
+  frame_clock frame_timer;
   int now;
   int s, i, j;
   FILE* fp;
   int clock_delay = 0;
-  int time_buffer[11], ti = 0, tf = 0;
   int last_button_count = 0;
+  int pattern_stage, fins_stage, lids_stage, render_stage;
+  int64_t frame_start, stage_start;
 
   serpent_mode = getenv("BLACK_SERPENT") ? JORMUNGAND : JULUNGGUL;
+  if (getenv("SERPENT_RECORD")) {
+    recorder_open(getenv("SERPENT_RECORD"));
+  }
 
-  bzero(head, HEAD_PIXELS*3);
-  bzero(segments, NUM_SEGS*(SEG_PIXELS + FIN_PIXELS)*3);
+  init_strand_buffers();
 
   // Assign addresses to all the barrels in the order they're connected.
   tcp_init();
@@ -408,20 +579,41 @@ int main(int argc, char* argv[]) {
   midi_init();
   midi_set_control(6, 10);
 
+  stage_stats_init();
+  pattern_stage = stage_stats_add("next_frame");
+  fins_stage = stage_stats_add("fins");
+  lids_stage = stage_stats_add("lids");
+  render_stage = stage_stats_add("render");
+  send_stage = stage_stats_add("send");
+  latency_stage = stage_stats_add("latency");
+
+  // Frame N is sent on this thread while frame N + 1 is rendered.
+  sem_init(&output_wakeup, 0, 0);
+  output_running = 1;
+  if (pthread_create(&output_thread, NULL, output_loop, NULL) != 0) {
+    perror("Could not start output thread");
+    return 1;
+  }
+
+  fps = frame_clock_rate("SERPENT_FPS", FPS, MAX_FPS);
+  frame_seconds = 1.0/fps;
+  frame_clock_init(&frame_timer, fps, FRAME_CLOCK_SKIP);
   while (1) {
     midi_poll();
 
-    while (now < next_frame_time) {
-      now = get_milliseconds();
-    }
-
+    frame_seconds = frame_clock_seconds(&frame_timer,
+                                        frame_clock_wait(&frame_timer));
+    frame_start = stage_stats_start();
     next_frame(frame++);
+    stage_stats_end(pattern_stage, frame_start);
+
+    stage_start = stage_stats_start();
 
     if (midi_get_control(6) > 0 && midi_get_control(6) < 16) {
       // White fin chaser light
       int n = NUM_SEGS*FIN_PIXELS;
       float speed = (midi_get_control(6) - 8)/3.0;
-      fcount += speed;
+      fcount += speed*frame_seconds*FPS;
       if (fcount < -n/2) { fcount += n; }
       if (fcount > n/2) { fcount -= n; }
       for (i = 0; i < n; i++) {
@@ -458,51 +650,29 @@ int main(int argc, char* argv[]) {
     }
 
     put_fin_pixels(fins, NUM_SEGS*FIN_PIXELS);
+    stage_stats_end(fins_stage, stage_start);
 
     switch (serpent_mode) {
       case JULUNGGUL:
+        stage_start = stage_stats_start();
         set_lid_pixels();
-        tcp_put_pixels(1, head, HEAD_PIXELS);
-        for (s = 0; s < NUM_SEGS; s++) {
-          tcp_put_pixels(2 + s, segments[s],
-                         SEG_PIXELS + FIN_PIXELS + LID_PIXELS);
-        }
+        stage_stats_end(lids_stage, stage_start);
+        post_frame(buffers[back].strand_ptrs, strand_counts);
         break;
       case JORMUNGAND:
-        tcp_put_pixels(1, head, HEAD_PIXELS);
+        stage_start = stage_stats_start();
         for (s = 0; s < NUM_SEGS - 1; s++) {
-          remap_to_jormungand(s, segments[s], jormungand_segment);
-          tcp_put_pixels(2 + s, jormungand_segment, JORM_SEG_PIXELS);
+          remap_to_jormungand(s, segments[s], jormungand_segments[s]);
         }
-        tcp_put_pixels(11, segments[9], TAIL_PIXELS);
+        stage_stats_end(lids_stage, stage_start);
+        post_frame(buffers[back].jormungand_strand_ptrs,
+                   jormungand_strand_counts);
         break;
     }
+    stage_stats_end(render_stage, frame_start);
+    stage_stats_frame();
 
     now = get_milliseconds();
-    tf += (tf < 10);
-    ti = (ti + 1) % 11;
-    time_buffer[ti] = now;
-    printf("frame %5d (%4.1f fps)  [%c%c%c%c%c%c%c%c] %02x %02x %02x %02x %02x %02x %02x %02x  \r", frame,
-           tf*1000.0/(now - time_buffer[(ti + 11 - tf) % 11]),
-           midi_get_note(1) > 0 ? '1' : ' ',
-           midi_get_note(2) > 0 ? '2' : ' ',
-           midi_get_note(3) > 0 ? '3' : ' ',
-           midi_get_note(4) > 0 ? '4' : ' ',
-           midi_get_note(5) > 0 ? '5' : ' ',
-           midi_get_note(6) > 0 ? '6' : ' ',
-           midi_get_note(7) > 0 ? '7' : ' ',
-           midi_get_note(8) > 0 ? '8' : ' ',
-           midi_get_control(1),
-           midi_get_control(2),
-           midi_get_control(3),
-           midi_get_control(4),
-           midi_get_control(5),
-           midi_get_control(6),
-           midi_get_control(7),
-           midi_get_control(8));
-    fflush(stdout);
-
-    next_frame_time += 1000/FPS;
 
     // update_buttons();
     if (last_button_count == 0 && pressed_button_count == 1) {
@@ -541,5 +711,9 @@ int main(int argc, char* argv[]) {
     }
   }
 
+  output_running = 0;
+  sem_post(&output_wakeup);
+  pthread_join(output_thread, NULL);
+  recorder_close();
   fprintf(stderr, "Loop terminated.\n");
 }
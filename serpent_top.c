@@ -0,0 +1,93 @@
+// Shows the per-stage frame timings that a running serpent publishes
+// through stage_stats, refreshed once a second.
+//
+//   gcc -std=c99 -O3 -o serpent_top serpent_top.c
+//   ./serpent_top
+//
+// Each line covers the frames since the previous refresh; percentiles are
+// the upper edges of the log2 histogram buckets, so they are within a
+// factor of two.  The max column covers the whole run.
+
+#define _SVID_SOURCE 1
+#define _DEFAULT_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include "stage_stats.h"
+
+// Returns the upper edge, in ns, of the bucket holding the given fraction
+// of the samples, but no more than the largest sample.
+double percentile(uint32_t* buckets, uint32_t count, double fraction,
+                  uint32_t max_ns) {
+  double edge;
+  uint32_t seen = 0;
+  int b;
+
+  for (b = 0; b < STAGE_STATS_BUCKETS; b++) {
+    seen += buckets[b];
+    if (seen >= count*fraction) {
+      break;
+    }
+  }
+  edge = 2ULL << (b < STAGE_STATS_BUCKETS ? b : b - 1);
+  return edge < max_ns ? edge : max_ns;
+}
+
+int main(int argc, char** argv) {
+  key_t ipc_token;
+  int shm_id, s, b;
+  stage_stats_table* table;
+  stage_stats_table previous, current;
+  uint32_t buckets[STAGE_STATS_BUCKETS], count;
+  stage_histogram* h;
+  stage_histogram* p;
+
+  ipc_token = ftok(STAGE_STATS_PATH, 'S');
+  shm_id = ipc_token == -1 ? -1 :
+      shmget(ipc_token, sizeof(stage_stats_table), 0644);
+  if (shm_id == -1) {
+    fprintf(stderr, "No serpent is running (%s not found)\n",
+            STAGE_STATS_PATH);
+    return 1;
+  }
+  table = shmat(shm_id, NULL, SHM_RDONLY);
+  if (table == (void*) -1 || table->magic != STAGE_STATS_MAGIC) {
+    fprintf(stderr, "Could not attach to stage statistics\n");
+    return 1;
+  }
+
+  memcpy(&previous, table, sizeof(previous));
+  while (1) {
+    sleep(1);
+    memcpy(&current, table, sizeof(current));
+    if (current.frames < previous.frames) {
+      memset(&previous, 0, sizeof(previous));  // the serpent was restarted
+    }
+    printf("\033[H\033[J%u frames, %u in the last second\n\n",
+           current.frames, current.frames - previous.frames);
+    printf("%-16s %7s %10s %10s %10s %10s\n",
+           "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+    for (s = 0; s < current.num_stages && s < STAGE_STATS_MAX_STAGES; s++) {
+      h = &current.stages[s];
+      p = &previous.stages[s];
+      count = h->count - p->count;
+      for (b = 0; b < STAGE_STATS_BUCKETS; b++) {
+        buckets[b] = h->buckets[b] - p->buckets[b];
+      }
+      printf("%-16.15s %7u", h->name, count);
+      if (count) {
+        printf(" %10.1f %10.1f %10.1f %10.1f\n",
+               (h->total_ns - p->total_ns)*1e-3/count,
+               percentile(buckets, count, 0.5, h->max_ns)*1e-3,
+               percentile(buckets, count, 0.99, h->max_ns)*1e-3,
+               h->max_ns*1e-3);
+      } else {
+        printf(" %10s %10s %10s %10.1f\n", "-", "-", "-", h->max_ns*1e-3);
+      }
+    }
+    fflush(stdout);
+    previous = current;
+  }
+}
@@ -0,0 +1,79 @@
+#define _SVID_SOURCE 1
+#define _DEFAULT_SOURCE 1
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include <unistd.h>
+#include "frame_clock.h"
+#include "stage_stats.h"
+
+static stage_stats_table private_table;
+static stage_stats_table* table = &private_table;
+
+void stage_stats_init() {
+  key_t ipc_token;
+  int shm_id, fd;
+  void* shm;
+
+  /* ftok() needs the file to exist. */
+  fd = open(STAGE_STATS_PATH, O_CREAT | O_RDONLY, 0644);
+  if (fd >= 0) {
+    close(fd);
+  }
+  ipc_token = ftok(STAGE_STATS_PATH, 'S');
+  if (ipc_token == -1) {
+    return;
+  }
+  shm_id = shmget(ipc_token, sizeof(stage_stats_table), 0644 | IPC_CREAT);
+  if (shm_id == -1) {
+    perror("Could not create stage statistics segment");
+    return;
+  }
+  shm = shmat(shm_id, NULL, 0);
+  if (shm == (void*) -1) {
+    return;
+  }
+  table = shm;
+  memset(table, 0, sizeof(stage_stats_table));
+  table->magic = STAGE_STATS_MAGIC;
+}
+
+int stage_stats_add(char* name) {
+  int s;
+
+  for (s = 0; s < table->num_stages; s++) {
+    if (!strncmp(table->stages[s].name, name, 15)) {
+      return s;
+    }
+  }
+  if (s >= STAGE_STATS_MAX_STAGES) {
+    return STAGE_STATS_MAX_STAGES - 1;
+  }
+  strncpy(table->stages[s].name, name, 15);
+  table->num_stages = s + 1;
+  return s;
+}
+
+int64_t stage_stats_start() {
+  return frame_clock_now_ns();
+}
+
+void stage_stats_end(int stage, int64_t start_ns) {
+  stage_histogram* h = &table->stages[stage];
+  int64_t elapsed = frame_clock_now_ns() - start_ns;
+  uint32_t ns = elapsed > 0xffffffff ? 0xffffffff : elapsed;
+  int b = ns ? 31 - __builtin_clz(ns) : 0;
+
+  h->buckets[b < STAGE_STATS_BUCKETS ? b : STAGE_STATS_BUCKETS - 1]++;
+  h->total_ns += ns;
+  if (ns > h->max_ns) {
+    h->max_ns = ns;
+  }
+  h->count++;
+}
+
+void stage_stats_frame() {
+  table->frames++;
+}
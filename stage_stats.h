@@ -0,0 +1,51 @@
+// Latency histograms for the stages of each frame, published in shared
+// memory for serpent_top to display.
+#ifndef STAGE_STATS_H
+#define STAGE_STATS_H
+
+#include <stdint.h>
+
+/* The shared memory segment is keyed with ftok() on this file. */
+#define STAGE_STATS_PATH "/tmp/serpent-stats"
+#define STAGE_STATS_MAGIC 0x53544731  /* "STG1" */
+
+#define STAGE_STATS_MAX_STAGES 16
+
+/* Bucket b counts durations of [2^b, 2^(b+1)) nanoseconds; the last bucket */
+/* also takes anything longer. */
+#define STAGE_STATS_BUCKETS 32
+
+/* Each stage has one writer, and nothing is ever locked: a reader may see */
+/* a sample half-recorded, which is fine for monitoring. */
+typedef struct {
+  char name[16];
+  uint32_t count;
+  uint32_t max_ns;
+  uint64_t total_ns;
+  uint32_t buckets[STAGE_STATS_BUCKETS];
+} stage_histogram;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t num_stages;
+  uint32_t frames;
+  uint32_t reserved;
+  stage_histogram stages[STAGE_STATS_MAX_STAGES];
+} stage_stats_table;
+
+/* Creates (or reuses) the shared segment.  If that fails, the histograms */
+/* are kept in private memory instead, so the probes always work. */
+void stage_stats_init();
+
+/* Returns the index of a new stage, or of the existing one with this name. */
+int stage_stats_add(char* name);
+
+/* Probes: take the time at the start of a stage, then record the elapsed */
+/* time at the end of it. */
+int64_t stage_stats_start();
+void stage_stats_end(int stage, int64_t start_ns);
+
+/* Counts a completed frame. */
+void stage_stats_frame();
+
+#endif  /* STAGE_STATS_H */
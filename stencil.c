@@ -0,0 +1,159 @@
+#include <string.h>
+#include "parallel.h"
+#include "stencil.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+typedef struct {
+  stencil_grid* g;
+  float dt;
+  int first_row;
+} stencil_job;
+
+void stencil_setup(stencil_grid* g, int rows, int columns, int wrap,
+                   float* position, float* velocity) {
+  memset(g, 0, sizeof(*g));
+  g->rows = rows;
+  g->columns = columns;
+  g->wrap = wrap;
+  g->stride = columns + 2;
+  g->position = position;
+  g->velocity = velocity;
+  g->mass = 1;
+  g->bands = 1;
+  memset(position, 0, sizeof(float)*STENCIL_FLOATS(rows, columns));
+  memset(velocity, 0, sizeof(float)*STENCIL_FLOATS(rows, columns));
+}
+
+/* Copies the wrapped-around or edge positions into the ghost cells. */
+static void fill_ghosts(stencil_grid* g) {
+  float* p;
+  int r, n = g->columns;
+
+  for (r = 0; r < g->rows; r++) {
+    p = stencil_cell(g, g->position, r, 0);
+    p[-1] = g->wrap ? p[n - 1] : p[0];
+    p[n] = g->wrap ? p[0] : p[n - 1];
+  }
+  memcpy(stencil_cell(g, g->position, -1, -1),
+         stencil_cell(g, g->position, 0, -1), sizeof(float)*g->stride);
+  memcpy(stencil_cell(g, g->position, g->rows, -1),
+         stencil_cell(g, g->position, g->rows - 1, -1),
+         sizeof(float)*g->stride);
+}
+
+/* Updates the velocities of one row.  The vector versions do the same */
+/* operations in the same order, so every build gets the same results. */
+static void accelerate_row(const stencil_grid* g, int r, float dt) {
+  const float* p = stencil_cell(g, g->position, r, 0);
+  const float* up = p - g->stride;
+  const float* down = p + g->stride;
+  const float* push = g->push ? stencil_cell(g, g->push, r, 0) : NULL;
+  float* v = stencil_cell(g, g->velocity, r, 0);
+  float rate = dt/g->mass, c, laplacian, force;
+  int i = 0, n = g->columns;
+
+#if defined(__SSE2__)
+  __m128 spring = _mm_set1_ps(g->spring), anchor = _mm_set1_ps(g->anchor);
+  __m128 restore = _mm_set1_ps(g->restore), centre = _mm_set1_ps(g->centre);
+  __m128 friction = _mm_set1_ps(g->friction);
+  __m128 fast = _mm_set1_ps(g->min_velocity);
+  __m128 slow = _mm_set1_ps(-g->min_velocity), rate4 = _mm_set1_ps(rate);
+  __m128 cv, lv, fv, vv;
+  for (; i + 4 <= n; i += 4) {
+    cv = _mm_loadu_ps(p + i);
+    lv = _mm_add_ps(
+        _mm_add_ps(
+            _mm_add_ps(_mm_sub_ps(_mm_loadu_ps(p + i + 1), cv),
+                       _mm_sub_ps(_mm_loadu_ps(p + i - 1), cv)),
+            _mm_sub_ps(_mm_loadu_ps(up + i), cv)),
+        _mm_sub_ps(_mm_loadu_ps(down + i), cv));
+    fv = _mm_add_ps(
+        _mm_mul_ps(spring, _mm_sub_ps(lv, _mm_mul_ps(anchor, cv))),
+        _mm_mul_ps(restore, _mm_sub_ps(centre, cv)));
+    if (push) {
+      fv = _mm_add_ps(fv, _mm_loadu_ps(push + i));
+    }
+    vv = _mm_loadu_ps(v + i);
+    fv = _mm_sub_ps(fv, _mm_and_ps(_mm_cmpgt_ps(vv, fast), friction));
+    fv = _mm_add_ps(fv, _mm_and_ps(_mm_cmplt_ps(vv, slow), friction));
+    _mm_storeu_ps(v + i, _mm_add_ps(vv, _mm_mul_ps(fv, rate4)));
+  }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  float32x4_t friction = vdupq_n_f32(g->friction);
+  float32x4_t fast = vdupq_n_f32(g->min_velocity);
+  float32x4_t slow = vdupq_n_f32(-g->min_velocity);
+  float32x4_t cv, lv, fv, vv;
+  uint32x4_t zero = vdupq_n_u32(0);
+  for (; i + 4 <= n; i += 4) {
+    cv = vld1q_f32(p + i);
+    lv = vaddq_f32(
+        vaddq_f32(vaddq_f32(vsubq_f32(vld1q_f32(p + i + 1), cv),
+                            vsubq_f32(vld1q_f32(p + i - 1), cv)),
+                  vsubq_f32(vld1q_f32(up + i), cv)),
+        vsubq_f32(vld1q_f32(down + i), cv));
+    fv = vaddq_f32(
+        vmulq_n_f32(vsubq_f32(lv, vmulq_n_f32(cv, g->anchor)), g->spring),
+        vmulq_n_f32(vsubq_f32(vdupq_n_f32(g->centre), cv), g->restore));
+    if (push) {
+      fv = vaddq_f32(fv, vld1q_f32(push + i));
+    }
+    vv = vld1q_f32(v + i);
+    fv = vsubq_f32(fv, vreinterpretq_f32_u32(vbslq_u32(
+        vcgtq_f32(vv, fast), vreinterpretq_u32_f32(friction), zero)));
+    fv = vaddq_f32(fv, vreinterpretq_f32_u32(vbslq_u32(
+        vcltq_f32(vv, slow), vreinterpretq_u32_f32(friction), zero)));
+    vst1q_f32(v + i, vaddq_f32(vv, vmulq_n_f32(fv, rate)));
+  }
+#endif
+  for (; i < n; i++) {
+    c = p[i];
+    laplacian = (p[i + 1] - c) + (p[i - 1] - c) + (up[i] - c) + (down[i] - c);
+    force = g->spring*(laplacian - g->anchor*c) + g->restore*(g->centre - c);
+    if (push) {
+      force += push[i];
+    }
+    /* Subtracting or adding zero keeps this in step with the vectors. */
+    force -= v[i] > g->min_velocity ? g->friction : 0;
+    force += v[i] < -g->min_velocity ? g->friction : 0;
+    v[i] += force*rate;
+  }
+}
+
+static void accelerate_rows(void* context, int start, int end) {
+  stencil_job* job = context;
+
+  for (start += job->first_row; start < end + job->first_row; start++) {
+    accelerate_row(job->g, start, job->dt);
+  }
+}
+
+static void move_rows(void* context, int start, int end) {
+  stencil_job* job = context;
+  stencil_grid* g = job->g;
+  float* p = stencil_cell(g, g->position, start, -1);
+  float* v = stencil_cell(g, g->velocity, start, -1);
+  int i, n = (end - start)*g->stride;
+
+  /* The ghost velocities stay at zero, so the ghosts can move too. */
+  for (i = 0; i < n; i++) {
+    p[i] += v[i]*job->dt;
+  }
+}
+
+void stencil_tick(stencil_grid* g, float dt, int first_row) {
+  stencil_job job = {g, dt, first_row};
+
+  fill_ghosts(g);
+  if (g->bands > 1) {
+    parallel_for(g->rows - first_row, g->bands, accelerate_rows, &job);
+    parallel_for(g->rows, g->bands, move_rows, &job);
+  } else {
+    accelerate_rows(&job, 0, g->rows - first_row);
+    move_rows(&job, 0, g->rows);
+  }
+}
@@ -0,0 +1,48 @@
+// A solver for grids of masses joined by springs to their four neighbours,
+// as in the pond and swirl patterns.  Each row carries a ghost value at
+// either end, and the grid a ghost row above and below, so the inner loops
+// run without edge tests; the ghosts hold the wrapped-around columns of a
+// cylinder, or copies of the edge cells for a free edge.
+#ifndef STENCIL_H
+#define STENCIL_H
+
+/* The number of floats to allocate for each of a grid's arrays. */
+#define STENCIL_FLOATS(rows, columns) (((rows) + 2)*((columns) + 2))
+
+typedef struct {
+  int rows, columns;
+  int wrap;             /* whether the columns wrap around */
+  int stride;           /* floats from one row to the next */
+  float* position;      /* STENCIL_FLOATS(rows, columns) each */
+  float* velocity;
+  float* push;          /* an extra force on each cell, or NULL */
+
+  /* Each cell feels spring*(sum of (neighbour - cell) - anchor*cell) */
+  /* + restore*(centre - cell) + push, less 'friction' against its */
+  /* velocity if it is moving faster than min_velocity. */
+  float spring, anchor;
+  float restore, centre;
+  float friction, min_velocity;
+  float mass;
+  int bands;            /* blocks of rows to work on in parallel */
+} stencil_grid;
+
+/* Sets up a grid over the given arrays, clears them, and sets every */
+/* force to zero, the mass to 1 and bands to 1. */
+void stencil_setup(stencil_grid* g, int rows, int columns, int wrap,
+                   float* position, float* velocity);
+
+/* Returns the cell at (row, col) in one of the grid's arrays.  Rows -1 */
+/* and 'rows' and columns -1 and 'columns' are the ghosts. */
+static inline float* stencil_cell(const stencil_grid* g, float* values,
+                                  int row, int col) {
+  return values + (row + 1)*g->stride + col + 1;
+}
+
+/* Advances the grid by dt: updates the velocity of every cell in rows */
+/* first_row and after from the current positions, then moves every */
+/* cell.  Uses SSE2 or NEON if the build has them, and splits the rows */
+/* into g->bands blocks for the thread pool in parallel.h. */
+void stencil_tick(stencil_grid* g, float dt, int first_row);
+
+#endif  /* STENCIL_H */
@@ -0,0 +1,126 @@
+// Times stencil_tick() against the scalar loop that the pond pattern used
+// to run, on the pond's grid and on a finer one, with and without row
+// bands on the thread pool.
+//
+//   gcc -std=c99 -O3 stencil_bench.c stencil.c parallel.c -lm -lpthread -o bin/stencil_bench
+//   bin/stencil_bench 1000
+//
+// Each frame is 10 ticks, as in pond.  Exits with status 1 if the banded
+// solver gives different results from the unbanded one.
+
+#define _DEFAULT_SOURCE 1
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "parallel.h"
+#include "stencil.h"
+
+#define MAX_ROWS 480
+#define MAX_COLUMNS 100
+#define TICKS 10
+#define DT (2.0/30/TICKS)
+
+static float old_position[MAX_ROWS][MAX_COLUMNS];
+static float old_velocity[MAX_ROWS][MAX_COLUMNS];
+static float position[2][STENCIL_FLOATS(MAX_ROWS, MAX_COLUMNS)];
+static float velocity[2][STENCIL_FLOATS(MAX_ROWS, MAX_COLUMNS)];
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+// pond_tick() from master.c, before stencil.c, for any grid size.
+void old_tick(int rows, int columns, float dt) {
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < columns; j++) {
+      float delta =
+          (old_position[i][(j + 1) % columns] - old_position[i][j]) +
+          (old_position[i][(j + columns - 1) % columns] - old_position[i][j]);
+      if (i > 0) {
+        delta += (old_position[i - 1][j] - old_position[i][j]);
+      }
+      if (i < rows - 1) {
+        delta += (old_position[i + 1][j] - old_position[i][j]);
+      }
+      delta += -old_position[i][j]*0.02;
+      float force = 300 * delta;
+      if (old_velocity[i][j] > 0.02) {
+        force -= 10;
+      } else if (old_velocity[i][j] < -0.02) {
+        force += 10;
+      }
+      old_velocity[i][j] += force * dt;
+    }
+  }
+  for (int i = 0; i < rows; i++) {
+    for (int j = 0; j < columns; j++) {
+      old_position[i][j] += old_velocity[i][j] * dt;
+    }
+  }
+}
+
+void setup(stencil_grid* g, int k, int rows, int columns, int bands) {
+  stencil_setup(g, rows, columns, 1, position[k], velocity[k]);
+  g->spring = 300;
+  g->anchor = 0.02;
+  g->friction = 10;
+  g->min_velocity = 0.02;
+  g->bands = bands;
+  // Start from the same splash in both grids.
+  *stencil_cell(g, g->velocity, rows/2, columns/2) = 2000;
+}
+
+int main(int argc, char* argv[]) {
+  int frames = argc > 1 ? atoi(argv[1]) : 1000;
+  int sizes[][2] = {{120, 25}, {MAX_ROWS, MAX_COLUMNS}};
+  int bands = parallel_get_threads()*4;
+  int s, f, t, rows, columns, failed = 0;
+  double start, old_time, one_time, banded_time;
+  stencil_grid one, banded;
+
+  for (s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+    rows = sizes[s][0];
+    columns = sizes[s][1];
+    memset(old_velocity, 0, sizeof(old_velocity));
+    old_velocity[rows/2][columns/2] = 2000;
+    start = get_time();
+    for (f = 0; f < frames; f++) {
+      for (t = 0; t < TICKS; t++) {
+        old_tick(rows, columns, DT);
+      }
+    }
+    old_time = (get_time() - start)/frames;
+
+    setup(&one, 0, rows, columns, 1);
+    start = get_time();
+    for (f = 0; f < frames; f++) {
+      for (t = 0; t < TICKS; t++) {
+        stencil_tick(&one, DT, 0);
+      }
+    }
+    one_time = (get_time() - start)/frames;
+
+    setup(&banded, 1, rows, columns, bands);
+    start = get_time();
+    for (f = 0; f < frames; f++) {
+      for (t = 0; t < TICKS; t++) {
+        stencil_tick(&banded, DT, 0);
+      }
+    }
+    banded_time = (get_time() - start)/frames;
+
+    if (memcmp(position[0], position[1],
+               sizeof(float)*STENCIL_FLOATS(rows, columns))) {
+      fprintf(stderr, "%dx%d: %d bands differ from 1\n", rows, columns, bands);
+      failed = 1;
+    }
+    printf("%3dx%-3d  old %8.2f us/frame  stencil %8.2f  "
+           "%d bands on %d threads %8.2f\n", rows, columns, old_time*1e6,
+           one_time*1e6, bands, parallel_get_threads(), banded_time*1e6);
+  }
+  return failed;
+}
@@ -74,13 +74,17 @@ void swirl_tick(float dt) {
   }
 }
 
-void next_frame(int x) {
+void next_frame(int frame) {
   static int left_outer_eye_start = 182;
   static int right_outer_eye_start = 182 + 22 + 13 + 12 + 6;
   static int outer_eye_length = 22;
   static int inner_eye_length = 13;
+  static float ticks = 0;  // time since frame 0, in units of 1/FPS second
+  int x;
 
-  if (x == 0) {
+  ticks = frame == 0 ? 0 : ticks + get_frame_seconds()*FPS;
+  x = ticks;
+  if (frame == 0) {
     swirl_auto_impulse = 1;
     for (int i = 0; i < NUM_ROWS; i++) {
       swirl_position[i] = 0;
@@ -117,7 +121,7 @@ void next_frame(int x) {
   }
   
   for (int t = 0; t < SWIRL_TICKS_PER_FRAME; t++) {
-    swirl_tick(1.0/FPS/SWIRL_TICKS_PER_FRAME);
+    swirl_tick(get_frame_seconds()/SWIRL_TICKS_PER_FRAME);
   }
 
   for (int i = 0; i < NUM_ROWS; i++) {
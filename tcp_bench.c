@@ -0,0 +1,79 @@
+// Benchmark for the PSoC pixel protocol: per-address vs. batched frames.
+//
+// Build and run against a local receiver, e.g.:
+//   gcc -std=c99 -O3 tcp_bench.c tcp_pixels.c midi.c -o bin/tcp_bench
+//   gcc -std=c99 -O3 dummy_server.c opc_server.c -o bin/dummy_server
+//   bin/dummy_server 60666 > /dev/null &
+//   echo "127.0.0.1 60666" > /tmp/serpent
+//   bin/tcp_bench 10000
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include "serpent.h"
+#include "tcp_pixels.h"
+
+#define NUM_CHANNELS (1 + NUM_SEGS)
+#define STRAND_PIXELS (SEG_PIXELS + FIN_PIXELS + LID_PIXELS)
+
+static byte head[HEAD_PIXELS*3];
+static byte segments[NUM_SEGS][STRAND_PIXELS*3];
+static byte* strand_ptrs[NUM_CHANNELS];
+static int strand_counts[NUM_CHANNELS];
+
+double get_time() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return now.tv_sec + 1e-6*now.tv_usec;
+}
+
+void report(const char* name, int frames, double elapsed) {
+  int bytes_per_frame = 0;
+  int c;
+
+  for (c = 0; c < NUM_CHANNELS; c++) {
+    bytes_per_frame += 4 + strand_counts[c]*3 + 3;
+  }
+  printf("%-10s %8d frames  %8.3f s  %9.1f frames/s  %7.2f us/frame  "
+         "%7.2f MB/s\n", name, frames, elapsed, frames/elapsed,
+         elapsed*1e6/frames, frames*(double) bytes_per_frame/elapsed/1e6);
+}
+
+int main(int argc, char** argv) {
+  int frames = argc > 1 ? atoi(argv[1]) : 0;
+  int f, c;
+  double start;
+
+  if (frames <= 0) {
+    fprintf(stderr, "Usage: %s <frames>\n", argv[0]);
+    return 1;
+  }
+
+  strand_ptrs[0] = head;
+  strand_counts[0] = HEAD_PIXELS;
+  for (c = 1; c < NUM_CHANNELS; c++) {
+    strand_ptrs[c] = segments[c - 1];
+    strand_counts[c] = STRAND_PIXELS;
+  }
+  memset(head, 0x40, sizeof(head));
+  memset(segments, 0x80, sizeof(segments));
+  tcp_init();
+
+  // One message per address, as serpent_tcp used to send them.
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    for (c = 0; c < NUM_CHANNELS; c++) {
+      tcp_put_pixels(c + 1, strand_ptrs[c], strand_counts[c]);
+    }
+  }
+  report("separate", frames, get_time() - start);
+
+  // The whole frame in one write.
+  start = get_time();
+  for (f = 0; f < frames; f++) {
+    tcp_put_pixels_multi(strand_ptrs, strand_counts, NUM_CHANNELS);
+  }
+  report("batched", frames, get_time() - start);
+  return 0;
+}
@@ -6,7 +6,10 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
 #include <unistd.h>
 #include "midi.h"
 #include "tcp_pixels.h"
@@ -34,11 +37,16 @@ enum psoc_command {
 
 int sock = -1;
 
+/* Reusable buffer for the batched messages built by tcp_put_pixels_multi. */
+static byte* frame_buffer = NULL;
+static int frame_capacity = 0;
+
 int tcp_connect(char* ipaddr, int port) {
   char buffer[100];
   int sock = -1;
   struct sockaddr_in address;
   struct timeval timeout;
+  int one = 1;
   address.sin_family = AF_INET;
   address.sin_port = htons(port);
   if (inet_pton(AF_INET, ipaddr, &(address.sin_addr)) != 1) {
@@ -52,6 +60,9 @@ int tcp_connect(char* ipaddr, int port) {
   timeout.tv_usec = 0;
   setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
 
+  /* Each message goes out in one write, so don't let Nagle delay it. */
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
   /* Connect to the master PSoC board. */
   if (connect(sock, (struct sockaddr*) &address, sizeof(address)) != 0) {
     close(sock);
@@ -107,9 +118,41 @@ void tcp_send_sync(const byte* buf, int len) {
   }
 }
 
+/* Sends all the buffers in iov, reconnecting if necessary.  The iovec */
+/* array is modified as data is sent. */
+void tcp_send_syncv(struct iovec* iov, int iovcnt) {
+  struct msghdr message;
+  ssize_t result;
+  if (sock < 0) {
+    tcp_init();
+  }
+  memset(&message, 0, sizeof(message));
+  while (sock >= 0 && iovcnt > 0) {
+    message.msg_iov = iov;
+    message.msg_iovlen = iovcnt;
+    result = sendmsg(sock, &message, 0);
+    if (result < 0) {
+      perror("Write error");
+      close(sock);
+      sock = -1;
+      break;
+    }
+    while (iovcnt > 0 && result >= iov->iov_len) {
+      result -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (byte*) iov->iov_base + result;
+      iov->iov_len -= result;
+    }
+  }
+}
+
 void tcp_put_pixels(byte address, byte* pixels, int n) {
   byte header[4];
   byte extra_pixel[3] = {0, 0, 0};
+  struct iovec iov[3];
   int length;
 
   // Sometimes the last pixel doesn't get set; add one extra for reliability.
@@ -118,7 +161,50 @@ void tcp_put_pixels(byte address, byte* pixels, int n) {
   header[1] = CHANNEL_LED;
   header[2] = length >> 8;
   header[3] = length & 0xff;
-  tcp_send_sync(header, 4);
-  tcp_send_sync(pixels, n*3);
-  tcp_send_sync(extra_pixel, 3);
+  iov[0].iov_base = header;
+  iov[0].iov_len = 4;
+  iov[1].iov_base = pixels;
+  iov[1].iov_len = n*3;
+  iov[2].iov_base = extra_pixel;
+  iov[2].iov_len = 3;
+  tcp_send_syncv(iov, 3);
+}
+
+/* Sends pixel_counts[c] pixels from pixel_ptrs[c] to address c + 1, for all */
+/* channels at once: the messages are assembled back to back in one buffer */
+/* and handed to the socket in a single write. */
+void tcp_put_pixels_multi(byte** pixel_ptrs, int* pixel_counts,
+                          int num_channels) {
+  int c, n, length, total = 0;
+  byte* d;
+
+  for (c = 0; c < num_channels; c++) {
+    total += 4 + pixel_counts[c]*3 + 3;
+  }
+  if (total > frame_capacity) {
+    d = realloc(frame_buffer, total);
+    if (!d) {
+      fprintf(stderr, "Out of memory for a %d-byte frame\n", total);
+      return;
+    }
+    frame_buffer = d;
+    frame_capacity = total;
+  }
+
+  d = frame_buffer;
+  for (c = 0; c < num_channels; c++) {
+    n = pixel_counts[c];
+    // Sometimes the last pixel doesn't get set; add one extra for reliability.
+    length = n*3 + 3;
+    *d++ = c + 1;
+    *d++ = CHANNEL_LED;
+    *d++ = length >> 8;
+    *d++ = length & 0xff;
+    memcpy(d, pixel_ptrs[c], n*3);
+    d += n*3;
+    *d++ = 0;
+    *d++ = 0;
+    *d++ = 0;
+  }
+  tcp_send_sync(frame_buffer, total);
 }
@@ -1,4 +1,4 @@
 void tcp_init();
 void tcp_init_addresses();
 void tcp_put_pixels(byte address, byte* pixels, int n);
-void tcp_put_pixels_multi(byte** pixel_ptrs, int num_channels, int num_pixels);
+void tcp_put_pixels_multi(byte** pixel_ptrs, int* pixel_counts, int num_channels);